@@ -0,0 +1,668 @@
+// ----------------------------------------------------------------------------
+// sam9applet - Small routines uploaded to and run on the target.
+// ----------------------------------------------------------------------------
+//
+//   Copyright 2011 Michael E. Nagy
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+// ----------------------------------------------------------------------------
+//
+// The applets are kept here as assembled words (ARMv5TE, A32) with the
+// source alongside.  They use only pc-relative addressing, so they run
+// wherever Options.Applet puts them, and they preserve r4-r11 and lr as
+// RomBOOT's 'G' expects of anything that returns to it.
+//
+// ----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "sam9applet.h"
+
+// ----------------------------------------------------------------------------
+//  CRC32 of a range of target memory in blocks, one result word per block.
+//  Parameters: address, count, block size, result table.  The 256-entry
+//  table for the reflected polynomial 0xEDB88320 is built in scratch, so
+//  the results match Sam9Crc32() (and zlib's crc32()).
+// ----------------------------------------------------------------------------
+
+static const bit32 Crc32Code[] = {
+  0xe92d4ff0, //          push  {r4-r11, lr}
+  0xe28fb090, //          adr   r11, done_word
+  0xe99b000f, //          ldmib r11, {r0-r3}        ; address, count, block, results
+  0xe28b9014, //          add   r9, r11, #20        ; table in scratch
+  0xe59fa07c, //          ldr   r10, =0xEDB88320
+  0xe3a04000, //          mov   r4, #0
+  0xe1a05004, // table:   mov   r5, r4
+  0xe3a06008, //          mov   r6, #8
+  0xe1b050a5, // bit:     lsrs  r5, r5, #1
+  0x2025500a, //          eorcs r5, r5, r10
+  0xe2566001, //          subs  r6, r6, #1
+  0x1afffffb, //          bne   bit
+  0xe7895104, //          str   r5, [r9, r4, lsl #2]
+  0xe2844001, //          add   r4, r4, #1
+  0xe3540c01, //          cmp   r4, #256
+  0x1afffff5, //          bne   table
+  0xe3510000, // block:   cmp   r1, #0
+  0x0a00000e, //          beq   done
+  0xe1520001, //          cmp   r2, r1              ; this block's length
+  0x91a04002, //          movls r4, r2
+  0x81a04001, //          movhi r4, r1
+  0xe0411004, //          sub   r1, r1, r4
+  0xe3e05000, //          mvn   r5, #0
+  0xe4d06001, // byte:    ldrb  r6, [r0], #1
+  0xe0266005, //          eor   r6, r6, r5
+  0xe20660ff, //          and   r6, r6, #255
+  0xe7996106, //          ldr   r6, [r9, r6, lsl #2]
+  0xe0265425, //          eor   r5, r6, r5, lsr #8
+  0xe2544001, //          subs  r4, r4, #1
+  0x1afffff8, //          bne   byte
+  0xe1e05005, //          mvn   r5, r5
+  0xe4835004, //          str   r5, [r3], #4
+  0xeaffffee, //          b     block
+  0xe59f400c, // done:    ldr   r4, =APPLET_DONE
+  0xe58b4000, //          str   r4, [r11]
+  0xe8bd4ff0, //          pop   {r4-r11, lr}
+  0xe12fff1e, //          bx    lr
+  0xedb88320, //          .word 0xEDB88320
+  APPLET_DONE //          .word APPLET_DONE
+};
+
+static const Sam9Applet Crc32Applet = { Crc32Code, sizeof( Crc32Code) / 4, 4, 1024 };
+
+// ----------------------------------------------------------------------------
+//  Fill runs of target memory with a word value.  Parameters: the number
+//  of runs, then address, count and value for each.  Counts are non-zero
+//  multiples of 32 bytes, eight words are stored at a time.
+// ----------------------------------------------------------------------------
+
+static const bit32 FillCode[] = {
+  0xe92d4ff0, //          push  {r4-r11, lr}
+  0xe28fb050, //          adr   r11, done_word
+  0xe59b3004, //          ldr   r3, [r11, #4]       ; runs
+  0xe28b4008, //          add   r4, r11, #8
+  0xe2533001, // run:     subs  r3, r3, #1
+  0x4a00000b, //          bmi   done
+  0xe8b40007, //          ldmia r4!, {r0-r2}        ; address, count, value
+  0xe1a05002, //          mov   r5, r2
+  0xe1a06002, //          mov   r6, r2
+  0xe1a07002, //          mov   r7, r2
+  0xe1a08002, //          mov   r8, r2
+  0xe1a09002, //          mov   r9, r2
+  0xe1a0a002, //          mov   r10, r2
+  0xe1a0c002, //          mov   r12, r2
+  0xe8a017e4, // fill:    stmia r0!, {r2, r5-r10, r12}
+  0xe2511020, //          subs  r1, r1, #32
+  0x8afffffc, //          bhi   fill
+  0xeafffff1, //          b     run
+  0xe59f4008, // done:    ldr   r4, =APPLET_DONE
+  0xe58b4000, //          str   r4, [r11]
+  0xe8bd4ff0, //          pop   {r4-r11, lr}
+  0xe12fff1e, //          bx    lr
+  APPLET_DONE //          .word APPLET_DONE
+};
+
+static const Sam9Applet FillApplet = { FillCode, sizeof( FillCode) / 4, 1 + (SPARSE_RUNS * 3), 0 };
+
+// ----------------------------------------------------------------------------
+//  Expand a staged stream of LZ4 blocks.  Parameters: staging address,
+//  destination address.  Each chunk is a length word and an LZ4 block of
+//  that many bytes, padded to the next multiple of 128 bytes, and a zero
+//  length word ends the stream.  Blocks are expanded one after another.
+// ----------------------------------------------------------------------------
+
+static const bit32 Lz4Code[] = {
+  0xe92d4ff0, //          push  {r4-r11, lr}
+  0xe28fb0b8, //          adr   r11, done_word
+  0xe99b0003, //          ldmib r11, {r0, r1}       ; stage, destination
+  0xe5902000, // chunk:   ldr   r2, [r0]            ; block length
+  0xe3520000, //          cmp   r2, #0
+  0x0a000025, //          beq   done
+  0xe2803004, //          add   r3, r0, #4          ; block start
+  0xe0834002, //          add   r4, r3, r2          ; block end
+  0xe2822083, //          add   r2, r2, #131
+  0xe3c2207f, //          bic   r2, r2, #127
+  0xe0800002, //          add   r0, r0, r2          ; next chunk
+  0xe1530004, // seq:     cmp   r3, r4
+  0x2afffff5, //          bhs   chunk
+  0xe4d35001, //          ldrb  r5, [r3], #1        ; token
+  0xe1a06225, //          lsr   r6, r5, #4          ; literal length
+  0xe356000f, //          cmp   r6, #15
+  0x1a000003, //          bne   lit
+  0xe4d37001, // litext:  ldrb  r7, [r3], #1
+  0xe0866007, //          add   r6, r6, r7
+  0xe35700ff, //          cmp   r7, #255
+  0x0afffffb, //          beq   litext
+  0xe2566001, // lit:     subs  r6, r6, #1
+  0x54d37001, //          ldrbpl r7, [r3], #1
+  0x54c17001, //          strbpl r7, [r1], #1
+  0x5afffffb, //          bpl   lit
+  0xe1530004, //          cmp   r3, r4              ; last sequence has no match
+  0x2affffe7, //          bhs   chunk
+  0xe4d37001, //          ldrb  r7, [r3], #1        ; offset
+  0xe4d38001, //          ldrb  r8, [r3], #1
+  0xe1877408, //          orr   r7, r7, r8, lsl #8
+  0xe0418007, //          sub   r8, r1, r7
+  0xe205600f, //          and   r6, r5, #15         ; match length - 4
+  0xe356000f, //          cmp   r6, #15
+  0x1a000003, //          bne   match
+  0xe4d37001, // matext:  ldrb  r7, [r3], #1
+  0xe0866007, //          add   r6, r6, r7
+  0xe35700ff, //          cmp   r7, #255
+  0x0afffffb, //          beq   matext
+  0xe2866004, // match:   add   r6, r6, #4
+  0xe4d87001, // copy:    ldrb  r7, [r8], #1
+  0xe4c17001, //          strb  r7, [r1], #1
+  0xe2566001, //          subs  r6, r6, #1
+  0x1afffffb, //          bne   copy
+  0xeaffffde, //          b     seq
+  0xe59f4008, // done:    ldr   r4, =APPLET_DONE
+  0xe58b4000, //          str   r4, [r11]
+  0xe8bd4ff0, //          pop   {r4-r11, lr}
+  0xe12fff1e, //          bx    lr
+  APPLET_DONE //          .word APPLET_DONE
+};
+
+static const Sam9Applet Lz4Applet = { Lz4Code, sizeof( Lz4Code) / 4, 2, 0 };
+
+// ----------------------------------------------------------------------------
+//  Calculate the CRC32 (reflected polynomial 0xEDB88320, as zlib) of a
+//  block of bytes, the host side of the CRC32 applet.  Pass the CRC of the
+//  bytes before the block to continue it.
+// ----------------------------------------------------------------------------
+
+bit32 Sam9Crc32( const byte *Data, bit32 Count, bit32 Crc) {
+  Crc = ~Crc;
+  while (Count--) {
+    Crc ^= *Data++;
+    for (int i = 0; i < 8; i++) {
+      Crc = (Crc & 1) ? (Crc >> 1) ^ 0xedb88320 : (Crc >> 1);
+  } }
+  return ~Crc;
+}
+
+// ----------------------------------------------------------------------------
+//  Check that the applet area (plus Extra bytes of results after it) stays
+//  clear of a range of target memory the applet is to work on.
+// ----------------------------------------------------------------------------
+
+bool Sam9AppletFits( Sam9Session *Session, bit32 Address, bit32 Count, bit32 Extra) {
+  bit32 Applet = Session->Options.Applet;
+  if (Extra > APPLET_AREA) {
+    return false;
+  }
+  if ((Address + Count <= Applet) || (Applet + APPLET_AREA <= Address)) {
+    return true;
+  }
+  fprintf( stderr, "*** %sApplet area at $%x overlaps $%x-$%x, use --applet=address!\n", Session->Label, Applet, Address, Address + Count - 1);
+  return false;
+}
+
+// ----------------------------------------------------------------------------
+//  Upload an applet with Count parameter words (at most Applet.Params),
+//  call it with 'G' and wait for RomBOOT to answer again.  Characters sent while the applet runs are
+//  lost, so resynchronizing is retried until it returns or APPLET_MS have
+//  passed, then the done word tells whether it ran to completion.
+// ----------------------------------------------------------------------------
+
+bool Sam9AppletRun( Sam9Session *Session, const Sam9Applet &Applet, const bit32 *Params, bit32 Count) {
+  bit32 Address = Session->Options.Applet;
+  bit32 Words = Applet.Words + 1 + Count;
+  byte Image[APPLET_AREA];
+  bit32 Done = 0;
+  for (bit32 i = 0; i < Words; i++) {
+    bit32 Value = (i < Applet.Words) ? Applet.Code[i] : (i == Applet.Words) ? 0 : Params[i - Applet.Words - 1];
+    for (int j = 0; j < 4; j++) {
+      Image[i*4 + j] = (Value >> (j*8)) & 0xff;
+  } }
+  if (Sam9WriteMemory( Session, Address, Image, Words * 4) == false) {
+    return false;
+  }
+  fprintf( Session->FileHandle, "G%X#\n", Address);
+  fflush( Session->FileHandle);
+  if (Session->Options.Trace) {
+    printf( "G%X#", Address);
+  }
+  double Deadline = TimeNow() + APPLET_MS / 1000.0;
+  int Attempts = 0;
+  while (Sam9Sync( Session) == false) {
+    if (TimeNow() > Deadline) {
+      fprintf( stderr, "*** %sApplet at $%x did not return!\n", Session->Label, Address);
+      return false;
+    }
+    Attempts++;
+  }
+  if (Attempts) { // replies to earlier attempts may still be on their way
+    GetResponse( Session, Session->Options.Trace, FRAME_DRAIN, PIPELINE_DRAIN_MS);
+    Sam9Sync( Session);
+  }
+  if (Sam9Read( Session, Address + Applet.Words * 4, 4, Done, Session->Options.Trace) && (Done == APPLET_DONE)) {
+    return true;
+  }
+  fprintf( stderr, "*** %sApplet at $%x did not complete!\n", Session->Label, Address);
+  return false;
+}
+
+// ----------------------------------------------------------------------------
+//  Calculate the CRC32 of each BlockSize bytes of a range of target memory
+//  (the last block may be short).  Crcs must have room for every block.
+// ----------------------------------------------------------------------------
+
+bool Sam9Checksums( Sam9Session *Session, bit32 Address, bit32 Count, bit32 BlockSize, bit32 *Crcs) {
+  bit32 Blocks = (Count + BlockSize - 1) / BlockSize;
+  bit32 Results = Session->Options.Applet + (Crc32Applet.Words + 1 + Crc32Applet.Params) * 4 + Crc32Applet.Scratch;
+  if (Sam9AppletFits( Session, Address, Count, Results + Blocks * 4 - Session->Options.Applet) == false) {
+    return false;
+  }
+  bit32 Params[] = { Address, Count, BlockSize, Results };
+  bool FlagProgress = Session->FlagProgress;
+  Session->FlagProgress = false;
+  bool Success = Sam9AppletRun( Session, Crc32Applet, Params, 4) && Sam9ReadMemory( Session, Results, (bptr) Crcs, Blocks * 4);
+  Session->FlagProgress = FlagProgress;
+  for (bit32 i = 0; Success && (i < Blocks); i++) {
+    bptr p = (bptr) &Crcs[i];
+    Crcs[i] = p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+  }
+  return Success;
+}
+
+// ----------------------------------------------------------------------------
+//  Verify target memory against a buffer by comparing a single CRC32 of the
+//  whole range.  If they disagree, block CRCs narrow the difference down and
+//  only the first differing block is read back to find the exact offset.
+//  Offset returns Count if memory matches.  Returns false if the target
+//  checksums are not to be had, so that the caller can read back instead.
+// ----------------------------------------------------------------------------
+
+bool Sam9VerifyCrc( Sam9Session *Session, bit32 Address, const byte *Buffer, bit32 Count, bit32 &Offset) {
+  bit32 Crcs[DELTA_BLOCKS];
+  Offset = Count;
+  if (Sam9Checksums( Session, Address, Count, Count, Crcs) == false) {
+    return false;
+  }
+  if (Crcs[0] == Sam9Crc32( Buffer, Count)) {
+    return true;
+  }
+  bit32 BlockSize = DELTA_BLOCK;
+  while (Count > BlockSize * DELTA_BLOCKS) {
+    BlockSize *= 2;
+  }
+  bit32 Blocks = (Count + BlockSize - 1) / BlockSize, Differ = 0, First = Blocks;
+  if (Sam9Checksums( Session, Address, Count, BlockSize, Crcs) == false) {
+    return false;
+  }
+  for (bit32 Block = 0; Block < Blocks; Block++) {
+    bit32 Start = Block * BlockSize;
+    if (Sam9Crc32( Buffer + Start, (Count - Start < BlockSize) ? Count - Start : BlockSize) != Crcs[Block]) {
+      First = (Differ++ == 0) ? Block : First;
+  } }
+  if (Session->Options.Quiet == false) {
+    printf( "%s%d of %d blocks of %d bytes differ.\n", Session->Label, Differ, Blocks, BlockSize);
+  }
+  if (Differ == 0) { // the whole range changed between the two passes
+    Offset = 0;
+    return true;
+  }
+  bit32 Start = First * BlockSize, Length = (Count - Start < BlockSize) ? Count - Start : BlockSize;
+  bptr Memory = (bptr) malloc( Length);
+  Offset = Start;
+  if (Memory && Sam9ReadMemory( Session, Address + Start, Memory, Length)) {
+    for (bit32 i = 0; i < Length; i++) {
+      if (Memory[i] != Buffer[Start + i]) {
+        Offset = Start + i;
+        break;
+  } } }
+  free( Memory);
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+//  Write a buffer to target memory, sending only the blocks whose CRC32 on
+//  the target differs from the buffer's.  Runs of changed blocks are sent
+//  together by Sam9WriteMemory().  If the target checksums are not to be
+//  had the whole buffer is sent.  Sent returns the bytes actually written.
+// ----------------------------------------------------------------------------
+
+bool Sam9WriteDelta( Sam9Session *Session, bit32 Address, const byte *Buffer, bit32 Count, bit32 &Sent) {
+  bit32 Crcs[DELTA_BLOCKS];
+  bit32 BlockSize = DELTA_BLOCK;
+  while (Count > BlockSize * DELTA_BLOCKS) {
+    BlockSize *= 2;
+  }
+  bit32 Blocks = (Count + BlockSize - 1) / BlockSize;
+  Sent = Count;
+  if (Sam9Checksums( Session, Address, Count, BlockSize, Crcs) == false) {
+    printf( "%sTarget checksums unavailable, sending the whole file.\n", Session->Label);
+    return Sam9WriteMemory( Session, Address, Buffer, Count);
+  }
+  Sent = 0;
+  bit32 First = 0, Changed = 0;
+  bool FlagRun = false;
+  for (bit32 Block = 0; Block <= Blocks; Block++) {
+    bit32 Offset = Block * BlockSize;
+    bool Differs = (Block < Blocks) && (Sam9Crc32( Buffer + Offset, (Count - Offset < BlockSize) ? Count - Offset : BlockSize) != Crcs[Block]);
+    if (Differs) {
+      Changed++;
+      if (FlagRun == false) {
+        First = Block;
+        FlagRun = true;
+    } }
+    if (FlagRun && (Differs == false)) {
+      bit32 Start = First * BlockSize, Length = ((Offset < Count) ? Offset : Count) - Start;
+      if (Sam9WriteMemory( Session, Address + Start, Buffer + Start, Length) == false) {
+        return false;
+      }
+      Sent += Length;
+      FlagRun = false;
+  } }
+  if (Session->Options.Quiet == false) {
+    printf( "%s%d of %d blocks of %d bytes changed.\n", Session->Label, Changed, Blocks, BlockSize);
+  }
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+//  Fill target memory with a byte value.  The word-aligned middle, in whole
+//  32-byte pieces, is filled by the fill applet, the few bytes either side
+//  (or everything, if the applet cannot be used) are sent.  Sent returns
+//  the bytes actually written over the link.
+// ----------------------------------------------------------------------------
+
+bool Sam9FillMemory( Sam9Session *Session, bit32 Address, bit32 Count, byte Value, bit32 &Sent) {
+  bit32 Head = (4 - (Address & 3)) & 3;
+  Head = (Head < Count) ? Head : Count;
+  bit32 Body = (Count - Head) & ~31, Tail = Count - Head - Body;
+  bit32 Params[] = { 1, Address + Head, Body, Value * 0x01010101u };
+  Sent = Count;
+  if (Body && Sam9AppletFits( Session, Address + Head, Body, 0)) {
+    bool FlagProgress = Session->FlagProgress;
+    Session->FlagProgress = false;
+    bool Filled = Sam9AppletRun( Session, FillApplet, Params, 4);
+    Session->FlagProgress = FlagProgress;
+    if (Filled) {
+      Sent = Head + Tail;
+    }
+  }
+  bptr Buffer = (bptr) malloc( (Sent == Count) ? Count : 36);
+  if (Buffer == NULL) {
+    fprintf( stderr, "*** %sFailed to fill memory at $%x (%d bytes, malloc error)!\n", Session->Label, Address, Count);
+    return false;
+  }
+  memset( Buffer, Value, (Sent == Count) ? Count : 36);
+  bool Success = (Sent == Count) ? Sam9WriteMemory( Session, Address, Buffer, Count)
+               : ((Head == 0) || Sam9WriteMemory( Session, Address, Buffer, Head)) && ((Tail == 0) || Sam9WriteMemory( Session, Address + Count - Tail, Buffer, Tail));
+  free( Buffer);
+  return Success;
+}
+
+// ----------------------------------------------------------------------------
+//  Classify a SPARSE_CHUNK of the buffer: returns 0x00 or 0xff if every
+//  byte is that value, otherwise -1.  The chunk is scanned a 64-bit word at
+//  a time, or-ing and and-ing the words rather than testing each byte.
+// ----------------------------------------------------------------------------
+
+static int SparseChunk( const byte *Data) {
+  unsigned long long Words[SPARSE_CHUNK / 8];
+  memcpy( Words, Data, SPARSE_CHUNK);
+  unsigned long long Zero = 0, Ones = ~0ULL;
+  for (int i = 0; i < SPARSE_CHUNK / 8; i++) {
+    Zero |= Words[i];
+    Ones &= Words[i];
+  }
+  return (Zero == 0) ? 0x00 : (Ones == ~0ULL) ? 0xff : -1;
+}
+
+// ----------------------------------------------------------------------------
+//  Write a buffer to target memory, filling runs of at least SPARSE_RUN
+//  bytes of 0x00 or 0xff on the target with the fill applet instead of
+//  sending them.  Runs are whole SPARSE_CHUNKs from the start of the buffer,
+//  so the segments in between stay whole XMODEM blocks.  The fill applet
+//  stores whole words, so up to three head bytes are sent first to bring
+//  the chunks onto a word boundary.  If the fill applet cannot be used the
+//  whole buffer is sent.  Sent returns the bytes actually written.
+// ----------------------------------------------------------------------------
+
+bool Sam9WriteSparse( Sam9Session *Session, bit32 Address, const byte *Buffer, bit32 Count, bit32 &Sent) {
+  bit32 Chunks = Count / SPARSE_CHUNK, Runs = 0;
+  bit32 Params[1 + (SPARSE_RUNS * 3)];
+  bit32 Start = 0;            // offset of the next byte not yet sent
+  bit32 Head = (4 - (Address & 3)) & 3;
+  if (Head && (Count > Head)) {
+    bool Success = Sam9WriteMemory( Session, Address, Buffer, Head) && Sam9WriteSparse( Session, Address + Head, Buffer + Head, Count - Head, Sent);
+    Sent += Head;
+    return Success;
+  }
+  Sent = 0;
+  if (Head) { // too short to reach a word boundary
+    Sent = Count;
+    return Sam9WriteMemory( Session, Address, Buffer, Count);
+  }
+  if (Sam9AppletFits( Session, Address, Count, 0) == false) {
+    printf( "%sFill applet unavailable, sending the whole file.\n", Session->Label);
+    Sent = Count;
+    return Sam9WriteMemory( Session, Address, Buffer, Count);
+  }
+  for (bit32 Chunk = 0; Chunk <= Chunks; ) {
+    int Value = (Chunk < Chunks) ? SparseChunk( Buffer + Chunk * SPARSE_CHUNK) : -1;
+    bit32 First = Chunk++;
+    while ((Value >= 0) && (Chunk < Chunks) && (SparseChunk( Buffer + Chunk * SPARSE_CHUNK) == Value)) {
+      Chunk++;
+    }
+    bit32 Offset = First * SPARSE_CHUNK, Length = (Chunk - First) * SPARSE_CHUNK;
+    bool FlagRun = (Value >= 0) && (Length >= SPARSE_RUN);
+    if (FlagRun) {
+      Params[1 + Runs*3 + 0] = Address + Offset;
+      Params[1 + Runs*3 + 1] = Length;
+      Params[1 + Runs*3 + 2] = (Value == 0) ? 0 : 0xffffffff;
+      Runs++;
+    }
+    if (FlagRun || (Chunk > Chunks)) { // send what came before the run, or the rest
+      bit32 End = FlagRun ? Offset : Count;
+      if ((End > Start) && (Sam9WriteMemory( Session, Address + Start, Buffer + Start, End - Start) == false)) {
+        return false;
+      }
+      Sent += End - Start;
+      Start = FlagRun ? Offset + Length : Count;
+    }
+    if ((Runs == SPARSE_RUNS) || (Runs && (Chunk > Chunks))) {
+      Params[0] = Runs;
+      if (Sam9AppletRun( Session, FillApplet, Params, 1 + (Runs * 3)) == false) {
+        return false;
+      }
+      Runs = 0;
+  } }
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+//  LZ4 block compression, greedy with a single hash probe per position.
+//  The output follows the block format rules (the last five bytes are
+//  literals, no match starts in the last twelve) so any LZ4 decoder, not
+//  just the applet, can expand it.  Output needs LZ4_BOUND( Count) bytes.
+// ----------------------------------------------------------------------------
+
+#define LZ4_HASH_BITS  12
+#define LZ4_MIN_MATCH  4
+#define LZ4_LAST_LITS  5
+#define LZ4_MATCH_LIMIT 12
+#define LZ4_BOUND(n)   ((n) + ((n) / 255) + 16)
+
+static bptr Lz4Length( bptr Out, bit32 Length) {
+  while (Length >= 255) {
+    *Out++ = 255;
+    Length -= 255;
+  }
+  *Out++ = Length;
+  return Out;
+}
+
+static bptr Lz4Sequence( bptr Out, const byte *Literals, bit32 LiteralCount, bit32 Offset, bit32 MatchLength) {
+  bit32 Extra = MatchLength ? MatchLength - LZ4_MIN_MATCH : 0;
+  *Out++ = ((LiteralCount < 15) ? LiteralCount : 15) << 4 | ((Extra < 15) ? Extra : 15);
+  if (LiteralCount >= 15) {
+    Out = Lz4Length( Out, LiteralCount - 15);
+  }
+  memcpy( Out, Literals, LiteralCount);
+  Out += LiteralCount;
+  if (MatchLength) {
+    *Out++ = Offset & 0xff;
+    *Out++ = Offset >> 8;
+    if (Extra >= 15) {
+      Out = Lz4Length( Out, Extra - 15);
+  } }
+  return Out;
+}
+
+static bit32 Lz4Compress( const byte *Source, bit32 Count, bptr Output) {
+  bit32 Table[1 << LZ4_HASH_BITS] = {}; // position + 1, zero for none
+  bptr Out = Output;
+  bit32 Anchor = 0, Position = 0;
+  while (Position + LZ4_MATCH_LIMIT < Count) {
+    bit32 Value, Other;
+    memcpy( &Value, Source + Position, 4);
+    bit32 Hash = (Value * 2654435761u) >> (32 - LZ4_HASH_BITS);
+    bit32 Candidate = Table[Hash];
+    Table[Hash] = Position + 1;
+    if (Candidate) {
+      memcpy( &Other, Source + Candidate - 1, 4);
+    }
+    if ((Candidate == 0) || (Position - (Candidate - 1) > 65535) || (Other != Value)) {
+      Position++;
+      continue;
+    }
+    bit32 Match = Candidate - 1, Length = LZ4_MIN_MATCH;
+    while ((Position + Length < Count - LZ4_LAST_LITS) && (Source[Match + Length] == Source[Position + Length])) {
+      Length++;
+    }
+    Out = Lz4Sequence( Out, Source + Anchor, Position - Anchor, Position - Match, Length);
+    Position += Length;
+    Anchor = Position;
+  }
+  Out = Lz4Sequence( Out, Source + Anchor, Count - Anchor, 0, 0);
+  return Out - Output;
+}
+
+// ----------------------------------------------------------------------------
+//  The image is compressed in COMPRESS_CHUNK pieces by a thread of its own
+//  while the sender stages the pieces already done, so compression and the
+//  link overlap.  Each piece is an independent LZ4 block.
+// ----------------------------------------------------------------------------
+
+#define COMPRESS_SLOT(n) ((4 + LZ4_BOUND(n) + 127) & ~127) // staged chunk, padded
+
+struct Sam9Compressor {
+  const byte *Image;
+  bit32  Count;
+  bit32  Chunks;
+  bptr   Output;                      // one COMPRESS_SLOT per chunk
+  bit32  *Lengths;                    // staged bytes per chunk
+  bit32  Ready;                       // chunks compressed so far
+  pthread_mutex_t Lock;
+  pthread_cond_t Done;
+};
+
+static void *Sam9CompressThread( void *Argument) {
+  Sam9Compressor *Compressor = (Sam9Compressor *) Argument;
+  for (bit32 i = 0; i < Compressor->Chunks; i++) {
+    bit32 Offset = i * COMPRESS_CHUNK;
+    bit32 Length = (Compressor->Count - Offset < COMPRESS_CHUNK) ? Compressor->Count - Offset : COMPRESS_CHUNK;
+    bptr Slot = Compressor->Output + i * COMPRESS_SLOT( COMPRESS_CHUNK);
+    bit32 Packed = Lz4Compress( Compressor->Image + Offset, Length, Slot + 4);
+    for (int j = 0; j < 4; j++) {
+      Slot[j] = (Packed >> (j*8)) & 0xff;
+    }
+    pthread_mutex_lock( &Compressor->Lock);
+    Compressor->Lengths[i] = (4 + Packed + 127) & ~127;
+    Compressor->Ready = i + 1;
+    pthread_cond_signal( &Compressor->Done);
+    pthread_mutex_unlock( &Compressor->Lock);
+  }
+  return NULL;
+}
+
+// ----------------------------------------------------------------------------
+//  Write a buffer to target memory compressed: the LZ4 chunks are staged at
+//  Stage, the decompressor applet expands them to Address and the result is
+//  checked against the buffer with the CRC32 applet.  The staged chunks are
+//  checked against the image and the applet area as they are sent, at their
+//  compressed size.  If any step fails the buffer is sent uncompressed.
+//  Sent returns the bytes actually written.
+// ----------------------------------------------------------------------------
+
+bool Sam9WriteCompressed( Sam9Session *Session, bit32 Address, bit32 Stage, const byte *Buffer, bit32 Count, bit32 &Sent) {
+  Sam9Compressor Compressor = {};
+  Compressor.Image = Buffer;
+  Compressor.Count = Count;
+  Compressor.Chunks = (Count + COMPRESS_CHUNK - 1) / COMPRESS_CHUNK;
+  bit32 Limit = Compressor.Chunks * COMPRESS_SLOT( COMPRESS_CHUNK) + 4;
+  bit32 Offset = Count;
+  pthread_t Thread;
+  Sent = 0;
+  if (Sam9AppletFits( Session, Address, Count, 0)) {
+    Compressor.Output = (bptr) calloc( Limit, 1);
+    Compressor.Lengths = (bit32 *) calloc( Compressor.Chunks, sizeof( bit32));
+    pthread_mutex_init( &Compressor.Lock, NULL);
+    pthread_cond_init( &Compressor.Done, NULL);
+    bool Success = Compressor.Output && Compressor.Lengths && (pthread_create( &Thread, NULL, Sam9CompressThread, &Compressor) == 0);
+    bool Started = Success;
+    bit32 Staged = 0;
+    for (bit32 i = 0; Success && (i < Compressor.Chunks); i++) {
+      pthread_mutex_lock( &Compressor.Lock);
+      while (Compressor.Ready <= i) {
+        pthread_cond_wait( &Compressor.Done, &Compressor.Lock);
+      }
+      bit32 Length = Compressor.Lengths[i];
+      pthread_mutex_unlock( &Compressor.Lock);
+      bit32 End = Stage + Staged + Length + 4; // and the end marker
+      if ((Stage + Staged < Address + Count) && (Address < End)) {
+        fprintf( stderr, "*** %sStaging area at $%x (%d bytes so far) overlaps $%x-$%x, use --stage=address!\n", Session->Label, Stage, End - Stage, Address, Address + Count - 1);
+        Success = false;
+      } else {
+        Success = Sam9AppletFits( Session, Stage + Staged, Length + 4, 0)
+               && Sam9WriteMemory( Session, Stage + Staged, Compressor.Output + i * COMPRESS_SLOT( COMPRESS_CHUNK), Length);
+      }
+      Staged += Length;
+    }
+    if (Started) {
+      pthread_join( Thread, NULL);
+    }
+    if (Success) {
+      Sam9Write( Session, Stage + Staged, 4, 0, Session->Options.Trace);
+      Sent = Staged + 4;
+      bit32 Params[] = { Stage, Address };
+      bool FlagProgress = Session->FlagProgress;
+      Session->FlagProgress = false;
+      Success = Sam9AppletRun( Session, Lz4Applet, Params, 2) && Sam9VerifyCrc( Session, Address, Buffer, Count, Offset);
+      Session->FlagProgress = FlagProgress;
+    }
+    pthread_cond_destroy( &Compressor.Done);
+    pthread_mutex_destroy( &Compressor.Lock);
+    free( Compressor.Lengths);
+    free( Compressor.Output);
+    if (Success && (Offset == Count)) {
+      return true;
+    }
+    if (Success) {
+      fprintf( stderr, "*** %sDecompressed image differs at offset %d!\n", Session->Label, Offset);
+  } }
+  printf( "%sCompressed upload failed, sending the whole file.\n", Session->Label);
+  Sent += Count;
+  return Sam9WriteMemory( Session, Address, Buffer, Count);
+}
+
+// ----------------------------------------------------------------------------
+//  End
+// ----------------------------------------------------------------------------
@@ -0,0 +1,74 @@
+// ----------------------------------------------------------------------------
+// sam9applet - Small routines uploaded to and run on the target.
+// ----------------------------------------------------------------------------
+//
+//   Copyright 2011 Michael E. Nagy
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+// ----------------------------------------------------------------------------
+//
+// Some jobs are far cheaper on the target than over the serial link, so
+// sam9boot carries a few position-independent ARM routines ("applets") that
+// are uploaded to spare internal SRAM (Options.Applet) and called with the
+// RomBOOT 'G' command.  Each is followed in memory by its parameter block,
+// the first word of which it sets to APPLET_DONE before returning to
+// RomBOOT with 'bx lr', then by whatever scratch space it needs:
+//
+//     Options.Applet   code      Words words
+//                      Done      set to APPLET_DONE on return
+//                      params    Params words
+//                      scratch   Scratch bytes
+//
+// ----------------------------------------------------------------------------
+
+#ifndef SAM9APPLET_H
+#define SAM9APPLET_H
+
+#include "sam9lib.h"
+
+#define APPLET_AREA   4096       // bytes reserved at Options.Applet
+#define APPLET_DONE   0x600DC0DE // stored in the done word on return
+#define APPLET_MS     5000       // time allowed for an applet to return
+
+#define DELTA_BLOCK   1024       // smallest block compared by --delta
+#define DELTA_BLOCKS  512        // most blocks, larger images use larger blocks
+
+#define SPARSE_CHUNK  128        // granularity of --sparse runs (an XMODEM block)
+#define SPARSE_RUN    512        // shortest run of 0x00 or 0xff worth filling
+#define SPARSE_RUNS   64         // runs filled per applet call
+
+#define COMPRESS_CHUNK 16384     // --compress piece, compressed while others are sent
+
+struct Sam9Applet {
+  const bit32 *Code;                  // position-independent A32 code
+  bit32  Words;                       // code size in words
+  bit32  Params;                      // parameter words after the done word
+  bit32  Scratch;                     // scratch bytes after the parameters
+};
+
+bit32  Sam9Crc32( const byte *Data, bit32 Count, bit32 Crc = 0);
+bool   Sam9AppletFits( Sam9Session *Session, bit32 Address, bit32 Count, bit32 Extra);
+bool   Sam9AppletRun( Sam9Session *Session, const Sam9Applet &Applet, const bit32 *Params, bit32 Count);
+bool   Sam9Checksums( Sam9Session *Session, bit32 Address, bit32 Count, bit32 BlockSize, bit32 *Crcs);
+bool   Sam9VerifyCrc( Sam9Session *Session, bit32 Address, const byte *Buffer, bit32 Count, bit32 &Offset);
+bool   Sam9WriteDelta( Sam9Session *Session, bit32 Address, const byte *Buffer, bit32 Count, bit32 &Sent);
+bool   Sam9FillMemory( Sam9Session *Session, bit32 Address, bit32 Count, byte Value, bit32 &Sent);
+bool   Sam9WriteSparse( Sam9Session *Session, bit32 Address, const byte *Buffer, bit32 Count, bit32 &Sent);
+bool   Sam9WriteCompressed( Sam9Session *Session, bit32 Address, bit32 Stage, const byte *Buffer, bit32 Count, bit32 &Sent);
+
+#endif
+
+// ----------------------------------------------------------------------------
+//  End
+// ----------------------------------------------------------------------------
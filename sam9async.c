@@ -0,0 +1,526 @@
+// ----------------------------------------------------------------------------
+// sam9async - Coroutine RomBOOT sessions driven from a single thread.
+// ----------------------------------------------------------------------------
+//
+//   Copyright 2011 Michael E. Nagy
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+// ----------------------------------------------------------------------------
+//
+// The same protocol as the blocking functions in sam9lib.c, with every wait
+// for the port turned into a suspension.  The framing is sam9lib.c's own:
+// commands, window and checkpoint decisions come from the Pipeline*()
+// functions and XMODEM blocks are built and checked by XmodemBlock() and
+// XmodemBlockTake(), so only the waiting differs.  Input goes through the
+// session's serial ring buffer.  Built into libsam9boot.a.
+//
+// ----------------------------------------------------------------------------
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+#include "sam9async.h"
+
+#define ASYNC_EVENTS 64 // epoll events handled per wakeup
+#define ASYNC_BATCH  64 // word commands per write
+
+// ----------------------------------------------------------------------------
+//  Loop construction and task management.  Tasks are started in the order
+//  they were spawned, the first time Run() is called.
+// ----------------------------------------------------------------------------
+
+Sam9Loop::Sam9Loop( void) {
+  Epoll = epoll_create1( EPOLL_CLOEXEC);
+}
+
+Sam9Loop::~Sam9Loop( void) {
+  if (Epoll >= 0) {
+    close( Epoll);
+} }
+
+void Sam9Loop::Spawn( Sam9Task<bool> &&Task) {
+  Tasks.push_back( std::move( Task));
+}
+
+// ----------------------------------------------------------------------------
+//  Run until every spawned task has finished.  Each pass waits for port
+//  events no longer than the nearest deadline, then resumes every session
+//  whose port fired or whose deadline has passed.  A resumed session runs
+//  until it next suspends, so the loop never blocks on any one port.
+// ----------------------------------------------------------------------------
+
+void Sam9Loop::Run( void) {
+  struct epoll_event Events[ASYNC_EVENTS];
+  for (auto &Task : Tasks) {
+    if (Task.Handle.done() == false) {
+      Task.Handle.resume();
+  } }
+  for (;;) {
+    bool Pending = false;
+    for (auto &Task : Tasks) {
+      Pending |= (Task.Handle.done() == false);
+    }
+    if (Pending == false) {
+      break;
+    }
+    double Now = TimeNow(), Nearest = Now + 1.0;
+    for (auto Async : Sessions) {
+      if (Async->Waiter && (Async->Deadline < Nearest)) {
+        Nearest = Async->Deadline;
+    } }
+    int Milliseconds = (Nearest > Now) ? (int) ((Nearest - Now) * 1000.0) + 1 : 0;
+    int n = epoll_wait( Epoll, Events, ASYNC_EVENTS, Milliseconds);
+    for (int i = 0; i < n; i++) {
+      ((Sam9AsyncSession *) Events[i].data.ptr)->Fired = true;
+    }
+    Now = TimeNow();
+    std::vector<Sam9AsyncSession *> Ready;
+    for (auto Async : Sessions) {
+      if (Async->Waiter && (Async->Fired || (Now >= Async->Deadline))) {
+        Ready.push_back( Async);
+    } }
+    for (auto Async : Ready) { // resuming may open or close other sessions
+      std::coroutine_handle<> Waiter = std::exchange( Async->Waiter, nullptr);
+      Async->Fired = false;
+      Waiter.resume();
+} } }
+
+// ----------------------------------------------------------------------------
+//  Arm the port for one event and park the caller.  EPOLLONESHOT keeps a
+//  busy port from waking the loop while its session is not waiting.
+// ----------------------------------------------------------------------------
+
+void Sam9AsyncSession::Arm( bit32 Events, double Until, std::coroutine_handle<> Caller) {
+  struct epoll_event Event = {};
+  Event.events = Events | EPOLLONESHOT;
+  Event.data.ptr = this;
+  epoll_ctl( Loop->Epoll, EPOLL_CTL_MOD, Session->FileNumber, &Event);
+  Fired = false;
+  Deadline = Until;
+  Waiter = Caller;
+}
+
+// ----------------------------------------------------------------------------
+//  Write a block to the port, suspending while the driver has no room.
+// ----------------------------------------------------------------------------
+
+Sam9Task<bool> Sam9AsyncSession::Send( const void *Data, int Count) {
+  const byte *p = (const byte *) Data;
+  double Until = TimeNow() + (XMODEM_BLOCK_MS / 1000.0);
+  while (Count > 0) {
+    int r = write( Session->FileNumber, p, Count);
+    if (r > 0) {
+      p += r;
+      Count -= r;
+    } else if ((r < 0) && (errno == EAGAIN) && (TimeNow() < Until)) {
+      co_await Wait( EPOLLOUT, Until);
+    } else {
+      co_return false;
+  } }
+  co_return true;
+}
+
+// ----------------------------------------------------------------------------
+//  Add whatever the driver has to the serial input buffer, suspending until
+//  something arrives or the deadline passes.  Returns true if input was
+//  added.
+// ----------------------------------------------------------------------------
+
+Sam9Task<bool> Sam9AsyncSession::Input( double Until) {
+  for (;;) {
+    if (Sam9ReadAvailable( Session) > 0) {
+      co_return true;
+    }
+    if (TimeNow() >= Until) {
+      co_return false;
+    }
+    co_await Wait( EPOLLIN, Until);
+} }
+
+// ----------------------------------------------------------------------------
+//  Take one buffered character, -1 if there is none.
+// ----------------------------------------------------------------------------
+
+int Sam9AsyncSession::Take( void) {
+  if (Sam9Buffered( Session) == 0) {
+    return -1;
+  }
+  return Session->SerialBuffer[Session->SerialTail++ & (SERIAL_BUFFER - 1)];
+}
+
+// ----------------------------------------------------------------------------
+//  Return one character, or -1 if none arrives within the specified number
+//  of milliseconds.
+// ----------------------------------------------------------------------------
+
+Sam9Task<int> Sam9AsyncSession::Byte( int Milliseconds) {
+  int c = Take();
+  if (c < 0) {
+    bool Added = co_await Input( TimeNow() + (Milliseconds / 1000.0));
+    c = Added ? Take() : -1;
+  }
+  co_return c;
+}
+
+// ----------------------------------------------------------------------------
+//  Collect Count characters, allowing up to the specified number of
+//  milliseconds between arrivals.  Returns the number collected.
+// ----------------------------------------------------------------------------
+
+Sam9Task<int> Sam9AsyncSession::Expect( bptr Data, int Count, int Milliseconds) {
+  int Length = 0;
+  while (Length < Count) {
+    int c = Take();
+    if (c >= 0) {
+      Data[Length++] = c;
+      continue;
+    }
+    bool Added = co_await Input( TimeNow() + (Milliseconds / 1000.0));
+    if (Added == false) {
+      break;
+  } }
+  co_return Length;
+}
+
+// ----------------------------------------------------------------------------
+//  Wait for a non-interactive mode text reply (the 'V#' version line), which
+//  ends with a CR/LF pair after some text.  Returns true if it was complete.
+// ----------------------------------------------------------------------------
+
+Sam9Task<bool> Sam9AsyncSession::Line( int Milliseconds) {
+  enum { StateLead, StateText, StateEnd } State = StateLead;
+  double Until = TimeNow() + (Milliseconds / 1000.0);
+  int Last = 0;
+  for (;;) {
+    int c = Take();
+    if (c < 0) {
+      bool Added = co_await Input( Until);
+      if (Added == false) {
+        co_return false;
+      }
+      continue;
+    }
+    bool End = (c == '\r') || (c == '\n');
+    switch (State) {
+      case StateLead: if (End == false) State = StateText; break;
+      case StateText: if (End) State = StateEnd;           break;
+      case StateEnd:
+        if (End && (c != Last)) {
+          co_return true;
+        } else if (End == false) {
+          State = StateText;
+        }
+        break;
+    }
+    Last = c;
+} }
+
+// ----------------------------------------------------------------------------
+//  Discard input until the line has been idle for the specified number of
+//  milliseconds.
+// ----------------------------------------------------------------------------
+
+Sam9Task<bool> Sam9AsyncSession::Drain( int Milliseconds) {
+  for (bool More = true; More; ) {
+    Session->SerialTail = Session->SerialHead;
+    More = co_await Input( TimeNow() + (Milliseconds / 1000.0));
+  }
+  co_return true;
+}
+
+// ----------------------------------------------------------------------------
+//  Pipelined word (and trailing byte) access, as Sam9Pipeline() and with
+//  the same bookkeeping (PipelineIssue() and friends), but always in
+//  non-interactive mode.  Each reply is exactly Size binary bytes, and
+//  silent writes are checked by reading the last one back.
+// ----------------------------------------------------------------------------
+
+Sam9Task<bool> Sam9AsyncSession::Words( bool Write, bit32 Address, bptr Buffer, bit32 Count) {
+  char Batch[(ASYNC_BATCH + 1) * SAM9_COMMAND_MAX];
+  Sam9Pipe Pipe;
+  PipelineStart( Session, Pipe, Write, Address, Buffer, Count);
+  while (Pipe.Done < Pipe.Total) {
+    int Length = 0;
+    for (int Queued = 0; PipelineRoom( Pipe) && (Queued < ASYNC_BATCH); Queued++) {
+      Length += PipelineIssue( Session, Pipe, Batch + Length);
+    }
+    int Size = PipelineSize( Pipe, Pipe.Checkpoint ? Pipe.Issued - 1 : Pipe.Done);
+    if (Pipe.Checkpoint) {
+      Length += PipelineCheckpoint( Session, Pipe, Batch + Length);
+    }
+    if (Length) {
+      bool Sent = co_await Send( Batch, Length);
+      if (Sent == false) {
+        co_return false;
+    } }
+    byte Reply[4];
+    int Received = co_await Expect( Reply, Size, RESPONSE_MS);
+    bit32 Value = 0;
+    for (int i = 0; i < Received; i++) {
+      Value |= Reply[i] << (i*8);
+    }
+    if ((Received == Size) && PipelineReply( Session, Pipe, Value)) {
+      continue;
+    }
+    if (PipelineFailed( Pipe) == false) {
+      co_return false;
+    }
+    co_await Drain( PIPELINE_DRAIN_MS);
+  }
+  co_return true;
+}
+
+// ----------------------------------------------------------------------------
+//  XMODEM transfers, as XmodemSend() and XmodemReceive() in sam9lib.c and
+//  with the same block framing.
+// ----------------------------------------------------------------------------
+
+Sam9Task<bool> Sam9AsyncSession::XmodemCancel( void) {
+  static const char Cancel[] = { XMODEM_CAN, XMODEM_CAN, XMODEM_CAN, '#', '\n' };
+  co_await Send( Cancel, sizeof( Cancel));
+  co_await Drain( PIPELINE_DRAIN_MS);
+  co_return true;
+}
+
+Sam9Task<bool> Sam9AsyncSession::XmodemSend( bit32 Address, const byte *Buffer, bit32 Count, bit32 BlockSize) {
+  byte Packet[3 + 1024 + 2];
+  char Command[SAM9_COMMAND_MAX];
+  int c;
+  bool Sent = co_await Send( Command, sprintf( Command, "S%x,%x#\n", Address, Count));
+  if (Sent == false) {
+    co_return false;
+  }
+  do { // wait for the receiver to start
+    c = co_await Byte( XMODEM_START_MS);
+  } while ((c >= 0) && (c != XMODEM_CRC) && (c != XMODEM_NAK));
+  if (c < 0) {
+    fprintf( stderr, "*** %sXMODEM transfer to $%x not started (target unresponsive)!\n", Session->Label, Address);
+    co_await XmodemCancel();
+    co_return false;
+  }
+  bool FlagCrc = (c == XMODEM_CRC);
+  bit32 Offset = 0;
+  byte Block = 1;
+  while (Offset < Count) {
+    int Size = ((BlockSize == 1024) && (Count - Offset >= 1024)) ? 1024 : 128;
+    int Length = XmodemBlock( Packet, Block, Buffer + Offset, Size, FlagCrc);
+    int Retry = 0;
+    for (c = -1; (c != XMODEM_ACK) && (Retry < XMODEM_RETRIES); Retry++) {
+      co_await Send( Packet, Length);
+      do {
+        c = co_await Byte( XMODEM_BLOCK_MS);
+      } while ((c >= 0) && (c != XMODEM_ACK) && (c != XMODEM_NAK) && (c != XMODEM_CAN));
+      if (c == XMODEM_CAN) {
+        break;
+    } }
+    if (c != XMODEM_ACK) {
+      fprintf( stderr, "*** %sXMODEM transfer to $%x failed at offset %d (%s)!\n", Session->Label, Address, Offset, (c == XMODEM_CAN) ? "cancelled by target" : "too many retries");
+      co_await XmodemCancel();
+      co_return false;
+    }
+    Offset += Size;
+    Block++;
+  }
+  for (int Retry = 0; Retry < XMODEM_RETRIES; Retry++) {
+    byte Eot = XMODEM_EOT;
+    co_await Send( &Eot, sizeof( Eot));
+    c = co_await Byte( XMODEM_BLOCK_MS);
+    if (c == XMODEM_ACK) {
+      co_return true;
+  } }
+  fprintf( stderr, "*** %sXMODEM transfer to $%x not acknowledged at end!\n", Session->Label, Address);
+  co_await XmodemCancel();
+  co_return false;
+}
+
+Sam9Task<bool> Sam9AsyncSession::XmodemReceive( bit32 Address, bptr Buffer, bit32 Count) {
+  byte Packet[2 + 1024 + 2];
+  char Command[SAM9_COMMAND_MAX];
+  byte Expected = 1;
+  byte Reply = XMODEM_CRC;
+  bit32 Offset = 0;
+  int Retry = 0, c;
+  bool Sent = co_await Send( Command, sprintf( Command, "R%X,%X#\n", Address, Count));
+  if (Sent == false) {
+    co_return false;
+  }
+  while (Retry < XMODEM_RETRIES) {
+    co_await Send( &Reply, sizeof( Reply));
+    int Timeout = (Offset || (Reply != XMODEM_CRC)) ? XMODEM_BLOCK_MS : XMODEM_BYTE_MS;
+    do { // wait for a block header
+      c = co_await Byte( Timeout);
+    } while ((c >= 0) && (c != XMODEM_SOH) && (c != XMODEM_STX) && (c != XMODEM_EOT) && (c != XMODEM_CAN));
+    if (c == XMODEM_EOT) {
+      byte Ack = XMODEM_ACK;
+      co_await Send( &Ack, sizeof( Ack));
+      if (Offset >= Count) {
+        co_return true;
+      }
+      fprintf( stderr, "*** %sXMODEM transfer from $%x ended early at offset %d!\n", Session->Label, Address, Offset);
+      co_return false;
+    }
+    if (c == XMODEM_CAN) {
+      fprintf( stderr, "*** %sXMODEM transfer from $%x cancelled by target at offset %d!\n", Session->Label, Address, Offset);
+      co_return false;
+    }
+    if (c < 0) {
+      Retry++;
+      continue;
+    }
+    int Size = (c == XMODEM_STX) ? 1024 : 128;
+    int Length = co_await Expect( Packet, Size + 4, XMODEM_BYTE_MS);
+    int Answer = XmodemBlockTake( Packet, Length, Size, Expected, Buffer, Count, Offset);
+    if (Answer == XMODEM_NAK) {
+      co_await Drain( 100);
+      Reply = XMODEM_NAK;
+      Retry++;
+      continue;
+    }
+    if (Answer == XMODEM_CAN) {
+      fprintf( stderr, "*** %sXMODEM transfer from $%x out of sequence at offset %d!\n", Session->Label, Address, Offset);
+      co_await XmodemCancel();
+      co_return false;
+    }
+    Reply = XMODEM_ACK;
+    Retry = 0;
+  }
+  fprintf( stderr, "*** %sXMODEM transfer from $%x failed at offset %d (too many retries)!\n", Session->Label, Address, Offset);
+  co_await XmodemCancel();
+  co_return false;
+}
+
+// ----------------------------------------------------------------------------
+//  Open the port non-blocking, add it to the loop, get RomBOOT's attention
+//  and switch it to non-interactive mode, then check that a version query
+//  gets a complete reply.
+// ----------------------------------------------------------------------------
+
+Sam9Task<bool> Sam9AsyncSession::Open( void) {
+  if ((Session->FileNumber = open( Session->Port, O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0) {
+    fprintf( stderr, "*** Unable to open device '%s' for i/o!\n", Session->Port);
+    co_return false;
+  }
+  Session->FileHandle = NULL;
+  bit32 ActualBaud = Sam9SetSerialMode( Session, Session->Options.Baud);
+  if (ActualBaud == 0) {
+    fprintf( stderr, "*** Unable to set '%s' to %d baud!\n", Session->Port, Session->Options.Baud);
+  } else if ((ActualBaud * 50 < Session->Options.Baud * 49) || (ActualBaud * 50 > Session->Options.Baud * 51)) {
+    fprintf( stderr, "*** Port '%s' set to %d baud, %d requested!\n", Session->Port, ActualBaud, Session->Options.Baud);
+  }
+  struct epoll_event Event = {};
+  Event.data.ptr = this;
+  Registered = (epoll_ctl( Loop->Epoll, EPOLL_CTL_ADD, Session->FileNumber, &Event) == 0);
+  if (Registered == false) {
+    fprintf( stderr, "*** Unable to add device '%s' to the event loop!\n", Session->Port);
+    co_return false;
+  }
+  Waiter = nullptr;
+  Loop->Sessions.push_back( this);
+  co_await Send( "#\n", 2);
+  co_await Drain( PIPELINE_DRAIN_MS);
+  co_await Send( "N#\n", 3);
+  co_await Drain( PIPELINE_DRAIN_MS);
+  Session->FlagBinary = true;
+  co_await Send( "V#\n", 3);
+  bool Framed = co_await Line( RESPONSE_MS);
+  if (Framed) {
+    co_return true;
+  }
+  fprintf( stderr, "*** Target on '%s' not responding!\n", Session->Port);
+  co_return false;
+}
+
+// ----------------------------------------------------------------------------
+//  Return RomBOOT to terminal mode unless it has been left by a jump, then
+//  take the port off the loop and close it.
+// ----------------------------------------------------------------------------
+
+Sam9Task<bool> Sam9AsyncSession::Close( void) {
+  if (Registered) {
+    if (Session->FlagBinary) {
+      co_await Send( "T#\n", 3);
+      co_await Drain( PIPELINE_DRAIN_MS);
+      Session->FlagBinary = false;
+    }
+    epoll_ctl( Loop->Epoll, EPOLL_CTL_DEL, Session->FileNumber, NULL);
+    std::erase( Loop->Sessions, this);
+    Registered = false;
+  }
+  if (Session->FileNumber >= 0) {
+    close( Session->FileNumber);
+    Session->FileNumber = -1;
+  }
+  co_return true;
+}
+
+// ----------------------------------------------------------------------------
+//  Memory access, XMODEM where it pays and words otherwise or as fallback,
+//  following Sam9ReadMemory() and Sam9WriteMemory().
+// ----------------------------------------------------------------------------
+
+Sam9Task<bool> Sam9AsyncSession::Read( bit32 Address, std::span<byte> Data) {
+  if (Session->Options.Xmodem && (Data.size() >= XMODEM_MINIMUM)) {
+    bool Received = co_await XmodemReceive( Address, Data.data(), Data.size());
+    if (Received) {
+      co_return true;
+    }
+    printf( "%sXMODEM download failed, falling back to word mode.\n", Session->Label);
+  }
+  bool Received = co_await Words( false, Address, Data.data(), Data.size());
+  if (Received) {
+    co_return true;
+  }
+  fprintf( stderr, "*** %sFailed to download memory from $%x (%d bytes expected, target unresponsive)!\n", Session->Label, Address, (int) Data.size());
+  co_return false;
+}
+
+Sam9Task<bool> Sam9AsyncSession::Write( bit32 Address, std::span<const byte> Data) {
+  bit32 Count = Data.size(), Length = 0;
+  if (Session->Options.Xmodem && (Count >= 128)) {
+    bool Sent = co_await XmodemSend( Address, Data.data(), Count & ~127, Session->Options.Xmodem);
+    if (Sent) {
+      Length = Count & ~127;
+    } else {
+      printf( "%sXMODEM upload failed, falling back to word mode.\n", Session->Label);
+  } }
+  bool Sent = co_await Words( true, Address + Length, (bptr) Data.data() + Length, Count - Length);
+  co_return Sent;
+}
+
+Sam9Task<bool> Sam9AsyncSession::Go( bit32 Address) {
+  char Command[SAM9_COMMAND_MAX];
+  bool Success = co_await Send( Command, sprintf( Command, "G%X#\n", Address));
+  co_await Drain( RESPONSE_IDLE_MS);
+  Session->FlagBinary = false; // RomBOOT is gone until the board is reset
+  co_return Success;
+}
+
+Sam9Task<bool> Sam9AsyncSession::PartId( bit32 &Id) {
+  byte Value[4];
+  bool Received = co_await Words( false, 0xfffff240, Value, sizeof( Value));
+  if (Received == false) {
+    co_return false;
+  }
+  Id = Value[0] | (Value[1] << 8) | (Value[2] << 16) | (Value[3] << 24);
+  co_return true;
+}
+
+// ----------------------------------------------------------------------------
+//  End
+// ----------------------------------------------------------------------------
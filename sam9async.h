@@ -0,0 +1,166 @@
+// ----------------------------------------------------------------------------
+// sam9async - Coroutine RomBOOT sessions driven from a single thread.
+// ----------------------------------------------------------------------------
+//
+//   Copyright 2011 Michael E. Nagy
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+// ----------------------------------------------------------------------------
+//
+// Each Sam9AsyncSession wraps a Sam9Session whose port is non-blocking.  Its
+// operations are C++20 coroutines that suspend whenever the port has no
+// input (or no room for output) and are resumed by a Sam9Loop, one epoll
+// loop for any number of ports:
+//
+//     Sam9Task<bool> Flash( Sam9AsyncSession *Async, std::span<const byte> Image) {
+//       if (co_await Async->Open()) {
+//         bool Success = co_await Async->Write( 0x300000, Image);
+//         co_await Async->Close();
+//         co_return Success;
+//       }
+//       co_return false;
+//     }
+//
+//     Sam9Loop Loop;
+//     Async[i] = { &Sessions[i], &Loop };   // for each port
+//     Loop.Spawn( Flash( &Async[i], Image));
+//     Loop.Run();
+//
+// RomBOOT is always driven in non-interactive 'N#' mode, so the echoing
+// terminal mode (-e) and the DBGU rate switch (-u) are not available here.
+//
+// ----------------------------------------------------------------------------
+
+#ifndef SAM9ASYNC_H
+#define SAM9ASYNC_H
+
+#include <stdlib.h>
+#include <coroutine>
+#include <utility>
+#include <vector>
+
+#include "sam9lib.h"
+
+// ----------------------------------------------------------------------------
+//  A lazily started coroutine returning a value.  Awaiting a task starts it
+//  and resumes the awaiting coroutine when it finishes, top-level tasks are
+//  started by Sam9Loop::Run().
+// ----------------------------------------------------------------------------
+
+template <typename T> struct Sam9Task {
+  struct promise_type {
+    T Value {};
+    std::coroutine_handle<> Continuation;
+
+    struct FinalAwaiter {
+      bool await_ready( void) noexcept { return false; }
+      std::coroutine_handle<> await_suspend( std::coroutine_handle<promise_type> Handle) noexcept {
+        std::coroutine_handle<> Next = Handle.promise().Continuation;
+        return Next ? Next : std::noop_coroutine();
+      }
+      void await_resume( void) noexcept {}
+    };
+
+    Sam9Task get_return_object( void) { return Sam9Task( std::coroutine_handle<promise_type>::from_promise( *this)); }
+    std::suspend_always initial_suspend( void) noexcept { return {}; }
+    FinalAwaiter final_suspend( void) noexcept { return {}; }
+    void return_value( T Result) { Value = Result; }
+    void unhandled_exception( void) { abort(); }
+  };
+
+  std::coroutine_handle<promise_type> Handle;
+
+  explicit Sam9Task( std::coroutine_handle<promise_type> h) : Handle( h) {}
+  Sam9Task( Sam9Task &&Other) : Handle( std::exchange( Other.Handle, nullptr)) {}
+  Sam9Task( const Sam9Task &) = delete;
+  ~Sam9Task() { if (Handle) Handle.destroy(); }
+
+  bool await_ready( void) { return false; }
+  std::coroutine_handle<> await_suspend( std::coroutine_handle<> Caller) {
+    Handle.promise().Continuation = Caller;
+    return Handle;
+  }
+  T await_resume( void) { return Handle.promise().Value; }
+};
+
+struct Sam9AsyncSession;
+
+// ----------------------------------------------------------------------------
+//  The event loop.  Sessions register their port with it when they open,
+//  a suspended session is resumed when its port is ready or its deadline
+//  passes, whichever comes first.
+// ----------------------------------------------------------------------------
+
+struct Sam9Loop {
+  int    Epoll = -1;
+  std::vector<Sam9AsyncSession *> Sessions;
+  std::vector<Sam9Task<bool>> Tasks;
+
+  Sam9Loop( void);
+  ~Sam9Loop( void);
+  void Spawn( Sam9Task<bool> &&Task);
+  void Run( void);
+};
+
+// ----------------------------------------------------------------------------
+//  One session on the loop.  Wait() suspends the caller until the port is
+//  ready for Events (EPOLLIN or EPOLLOUT) or the absolute Deadline (see
+//  TimeNow()) passes.
+// ----------------------------------------------------------------------------
+
+struct Sam9AsyncSession {
+  Sam9Session *Session;
+  Sam9Loop *Loop;
+  std::coroutine_handle<> Waiter;     // suspended coroutine, if any
+  double Deadline;                    // when to resume it regardless
+  bool   Fired;                       // port reported ready
+  bool   Registered;                  // port added to the loop
+
+  struct Sam9Wait {
+    Sam9AsyncSession *Async;
+    bit32  Events;
+    double Deadline;
+    bool await_ready( void) { return false; }
+    void await_suspend( std::coroutine_handle<> Caller) { Async->Arm( Events, Deadline, Caller); }
+    void await_resume( void) {}
+  };
+
+  Sam9Wait Wait( bit32 Events, double Deadline) { return { this, Events, Deadline }; }
+  void Arm( bit32 Events, double Deadline, std::coroutine_handle<> Caller);
+
+  Sam9Task<bool> Open( void);
+  Sam9Task<bool> Close( void);
+  Sam9Task<bool> Read( bit32 Address, std::span<byte> Data);
+  Sam9Task<bool> Write( bit32 Address, std::span<const byte> Data);
+  Sam9Task<bool> Go( bit32 Address);
+  Sam9Task<bool> PartId( bit32 &Id);
+
+  Sam9Task<bool> Send( const void *Data, int Count);
+  Sam9Task<bool> Input( double Until);
+  Sam9Task<int>  Expect( bptr Data, int Count, int Milliseconds);
+  Sam9Task<int>  Byte( int Milliseconds);
+  Sam9Task<bool> Line( int Milliseconds);
+  Sam9Task<bool> Drain( int Milliseconds);
+  Sam9Task<bool> Words( bool Write, bit32 Address, bptr Buffer, bit32 Count);
+  Sam9Task<bool> XmodemSend( bit32 Address, const byte *Buffer, bit32 Count, bit32 BlockSize);
+  Sam9Task<bool> XmodemReceive( bit32 Address, bptr Buffer, bit32 Count);
+  Sam9Task<bool> XmodemCancel( void);
+  int Take( void);
+};
+
+#endif
+
+// ----------------------------------------------------------------------------
+//  End
+// ----------------------------------------------------------------------------
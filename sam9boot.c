@@ -19,10 +19,11 @@
 // ----------------------------------------------------------------------------
 //
 // This program was developed and tested under Linux.  With minor changes it
-// should be possible to modify it to work under Windows as well.  To build
-// it using the GNU compiler:
+// should be possible to modify it to work under Windows as well.  The
+// RomBOOT session itself lives in libsam9boot (sam9lib.h, sam9lib.c), this
+// file is the command-line front end.  To build both using the GNU compiler:
 //
-//                         g++ sam9boot.c -o sam9boot
+//                                  make
 //
 // ----------------------------------------------------------------------------
 
@@ -32,35 +33,58 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <ctype.h>
+#include <poll.h>
+#include <sys/time.h>
 #include <termios.h>
 #include <signal.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <glob.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
-// ----------------------------------------------------------------------------
-//  Local types for conciseness.
-// ----------------------------------------------------------------------------
-
-typedef unsigned int  bit32; // unsigned 32-bit
-typedef unsigned char byte ; // unsigned  8-bit
-
-typedef FILE       *  fptr;
-typedef       char *  cptr;
-typedef const char * ccptr;
-typedef       byte *  bptr;
+#include "sam9lib.h"
+#include "sam9async.h"
+#include "sam9applet.h"
 
 // ----------------------------------------------------------------------------
 //  Command-line parameter values.
 // ----------------------------------------------------------------------------
 
-static ccptr ParamPort      = "/dev/ttyUSB0";
+static ccptr ParamPort      = "/dev/ttyUSB0"; // or the first of several -p
 static ccptr ParamFileName  = NULL;
 static ccptr ParamAddrStart = "$300000";
 static ccptr ParamAddrJump  = NULL;
 static ccptr ParamBytes     = NULL;
+static ccptr ParamXmodem    = NULL;
+static ccptr ParamWindow    = NULL;
+static ccptr ParamBaud      = NULL;
+static ccptr ParamTurbo     = NULL;
+static ccptr ParamMck       = NULL;
+static ccptr ParamDaemon    = NULL;
+static ccptr ParamSubmit    = NULL;
+static ccptr ParamServer    = NULL;
+static ccptr ParamConnect   = NULL;
+static ccptr ParamApplet    = NULL;
+static ccptr ParamStage     = NULL;
 
 static bit32 ValueAddrJump  = 0;
 static bit32 ValueAddrStart = 0;
 static bit32 ValueBytes     = 0;
+static bit32 ValueXmodem    = 128;
+static bit32 ValueWindow    = 8;
+static bit32 ValueBaud      = 115200;
+static bit32 ValueTurbo     = 0;
+static bit32 ValueMck       = 0;
+static bit32 ValueApplet    = 0x305000;
+static bit32 ValueStage     = 0;
 
 static bool FlagReceive     = false;
 static bool FlagDump        = false;
@@ -71,62 +95,87 @@ static bool FlagQuiet       = false;
 static bool FlagTrace       = false;
 static bool FlagInteractive = false;
 static bool FlagGo          = false;
+static bool FlagEcho        = false;
+static bool FlagPortGiven   = false;
+static bool FlagJumpDefault = false;
+static bool FlagAsync       = false;
+static bool FlagUring       = false;
+static bool FlagBench       = false;
+static bool FlagDelta       = false;
+static bool FlagCrc         = false;
+static bool FlagSparse      = false;
+static bool FlagCompress    = false;
+static bool FlagResume      = false;
 
 // ----------------------------------------------------------------------------
-//  Is input available on either the console or the RomBOOT serial port?
+//  Ports to flash.  Each -p adds a name or a glob pattern, the patterns are
+//  expanded into PortNames once all parameters have been parsed.  The
+//  daemon and the session server, if any, listen on a Unix socket, and
+//  --peek and --poke requests for the session server are kept in order.
 // ----------------------------------------------------------------------------
 
-static int FileInputAvailable( int FileNumber) {
-  struct timeval tv;
-  fd_set fds;
-  tv.tv_sec = 0;
-  tv.tv_usec = 4000; // make as small as possible while avoiding verification errors
-  FD_ZERO( &fds);
-  FD_SET( FileNumber, &fds);
-  return select( FileNumber+1, &fds, NULL, NULL, &tv);
-}
+#define PORTS_MAX     64
+#define DAEMON_SOCKET "/tmp/sam9boot.sock"         // default for --daemon and --submit
+#define SERVER_SOCKET "/tmp/sam9boot-session.sock" // default for --server and --connect
+#define REQUESTS_MAX  32                           // --peek and --poke per --connect
+
+static ccptr ParamPorts[PORTS_MAX];
+static int ParamPortCount = 0;
+
+static ccptr PortNames[PORTS_MAX];
+static int PortCount = 0;
+
+static ccptr ServerRequests[REQUESTS_MAX];
+static int ServerRequestCount = 0;
 
 // ----------------------------------------------------------------------------
-//  Return one character from either the console or the RomBOOT serial port.
+//  A file that cannot be mapped (-f=- or a pipe) is read by a thread into
+//  one buffer while the other is being sent.  A buffer short of
+//  STREAM_CHUNK bytes is the last.  The reader keeps the CRC32 of all it
+//  has read for -v.
 // ----------------------------------------------------------------------------
 
-static byte FileGetCharacter( int FileNumber) {
-  int r;
-  byte c;
-  if ((r = read( FileNumber, &c, sizeof(c))) < 0) {
-    return r;
-  }
-  return c;
-}
+#define STREAM_CHUNK 65536 // bytes read while the piece before is sent
+
+struct Sam9Reader {
+  int    FileNumber;
+  bit32  Limit;                       // -n, or zero to read to the end
+  bit32  Total;                       // bytes read so far
+  bit32  Crc;                         // CRC32 of those bytes
+  bool   Error;                       // read failed, the last buffer is short (under Lock)
+  byte   Buffer[2][STREAM_CHUNK];
+  bit32  Count[2];
+  bool   Full[2];                     // ready to send, or still to be filled
+  pthread_mutex_t Lock;
+  pthread_cond_t  Changed;
+};
+
+static Sam9Reader FileReader = { -1, 0, 0, 0, false, {}, {}, {}, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+static bool FlagStream = false;
 
 // ----------------------------------------------------------------------------
-//  Keep track of console and sam9 serial port file numbers and terminal
-//  io settings, and recent number of characters received from sam9.
+//  -r is written to disk by a thread as it arrives, see Sam9ReceiveFile().
 // ----------------------------------------------------------------------------
 
-static int FileNumberConsole, FileNumberSam9;
-static struct termios OriginalConsoleTermIOs;
-static bit32 ResponseCount = 0;
+#define RECEIVE_CHUNK   65536    // bytes per download command
+#define RECEIVE_BUFFERS 4        // pieces waiting for the writer, at most
+#define RECEIVE_INDEX   ".index" // sidecar listing the ranges received
 
 // ----------------------------------------------------------------------------
-//  Set up the sam9 serial port for 115200 i/o.
+//  --resume journals, one per port, file image and address, see
+//  Sam9WriteResumable().
 // ----------------------------------------------------------------------------
 
-static void Sam9SetSerialMode( void) {
-  struct termios Sam9TermIOs;
-  tcgetattr( FileNumberSam9, &Sam9TermIOs);
-//  memcpy( &NewTermIOs, &OriginalConsoleTermIOs, sizeof( NewTermIOs));
-//  cfmakeraw( &NewTermIOs);
-//  NewTermIOs.c_iflag |= BRKINT;
-  if (cfsetispeed( &Sam9TermIOs, B115200)) {
-    fprintf( stderr, "*** cfsetispeed FAIL!\n");
-  }
-  if (cfsetospeed( &Sam9TermIOs, B115200)) {
-    fprintf( stderr, "*** cfsetospeed FAIL!\n");
-  }
-  tcsetattr( FileNumberSam9, TCSANOW, &Sam9TermIOs);
-//  atexit( ConsoleResetRawMode);
-}
+#define RESUME_CHUNK   65536                  // bytes sent between checkpoints
+#define RESUME_CHECK   1024                   // bytes read back if no CRC32
+#define RESUME_JOURNAL "/tmp/sam9boot-resume" // journal name prefix
+
+// ----------------------------------------------------------------------------
+//  Keep track of console file number and terminal io settings.
+// ----------------------------------------------------------------------------
+
+static int FileNumberConsole;
+static struct termios OriginalConsoleTermIOs;
 
 // ----------------------------------------------------------------------------
 //  Reset console to initial terminal io settings.
@@ -151,73 +200,83 @@ static void ConsoleSetRawMode( void) {
 }
 
 // ----------------------------------------------------------------------------
-//  Catch any response from RomBOOT and display it unless the quiet flag is
-//  set.  If the response is a valid hex number, return the value.
+//  Copy everything in the serial input buffer to the console.
 // ----------------------------------------------------------------------------
 
-static bit32 GetResponse( int FileNumber, bool FlagTrace = true) {
-  static char Response[32];
-  int n = 0;
-  bit32 Value = 0;
-  ResponseCount = 0;
-  while (FileInputAvailable( FileNumber) && (n < (sizeof( Response) - 2))) {
-    Response[n++] = FileGetCharacter( FileNumber);
-    ResponseCount++;
-  }
-  if (n) {
-    int State = 0;
-    Response[n] = 0;
-    if (FlagTrace) {
-      printf( "%s", Response);
-    }
-    for (int i = 0; i < n; i++) {
-      char c = Response[i];
-      switch (State) {
-        case 0: if (c == '0') State = 1;                      break;
-        case 1: if (c == 'x') State = 2;      else State = 0; break;
-        case 2: sscanf( Response+i, "%X", &Value); State = 3; break;
-  } } }
-  return Value;
-}
+static void TerminalOutput( Sam9Session *Session) {
+  while (Sam9Buffered( Session)) {
+    bit32 Tail = Session->SerialTail & (SERIAL_BUFFER - 1);
+    int Chunk = Sam9Buffered( Session);
+    if (Chunk > (int) (SERIAL_BUFFER - Tail)) {
+      Chunk = SERIAL_BUFFER - Tail;
+    }
+    FileWriteBlock( FileNumberConsole, Session->SerialBuffer + Tail, Chunk);
+    Session->SerialTail += Chunk;
+} }
 
 // ----------------------------------------------------------------------------
 //  A primative pass-thru terminal emulator.  Set console to raw mode and set
 //  up to restore original settings on program exit.  Local echo is also
 //  implemented.  If a 'go' address is defined, execute it immediately after
-//  terminal initialization.
+//  terminal initialization.  The emulator sleeps in a single poll() on both
+//  the console and the RomBOOT serial port and moves whatever is available
+//  in bulk, so it does not wake up at all while the line is idle.
 // ----------------------------------------------------------------------------
 
-static void TerminalEmulator( fptr FileHandleSam9) {
-  byte Key = 0;
+static void TerminalEmulator( Sam9Session *Session) {
+  struct pollfd pfd[2];
+  bool Exit = false;
   printf( "\n[[ interactive terminal mode - <esc> or <ctrl-c> to exit%s ]]\n", ParamAddrJump && (FlagGo == false) ? ", <enter> or # to GO" : "");
   fflush( stdout);
   ConsoleSetRawMode();
   if (ParamAddrJump) {
-    fprintf( FileHandleSam9, "#\n", ValueAddrJump);
-    GetResponse( FileNumberSam9);
+    fprintf( Session->FileHandle, "#\n", ValueAddrJump);
+    GetResponse( Session);
     printf( "G%X%s", ValueAddrJump, FlagGo ? "#" : "");
     fflush( stdout);
-    fprintf( FileHandleSam9, "G%X%s", ValueAddrJump, FlagGo ? "#" : "");
-    fflush( FileHandleSam9);
-    GetResponse( FileNumberSam9);
-  }
-  do {
-    if (FileInputAvailable( FileNumberConsole)) {
-      Key = FileGetCharacter( FileNumberConsole);
-      if (Key == 0x0d) {
-        Key = '#'; // SAM-BA uses # as EOL character for some unknown reason
+    fprintf( Session->FileHandle, "G%X%s", ValueAddrJump, FlagGo ? "#" : "");
+    fflush( Session->FileHandle);
+    GetResponse( Session, true, FRAME_DRAIN, RESPONSE_IDLE_MS);
+    fflush( stdout);
+  }
+  pfd[0].fd = FileNumberConsole;
+  pfd[1].fd = Session->FileNumber;
+  pfd[0].events = pfd[1].events = POLLIN;
+  while (Exit == false) {
+    TerminalOutput( Session);
+    if (poll( pfd, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
       }
-      if ((Key != 0x1b) && (Key != 0x03)) { // escape or ctrl-c
-        write( FileNumberSam9, &Key, sizeof( Key));
+      break;
+    }
+    if (pfd[0].revents) {
+      byte Keys[256], Echo[256];
+      int Count = read( FileNumberConsole, Keys, sizeof( Keys)), Length = 0, EchoLength = 0;
+      if (Count <= 0) {
+        break; // console closed
+      }
+      for (int i = 0; i < Count; i++) {
+        byte Key = Keys[i];
+        if ((Key == 0x1b) || (Key == 0x03)) { // escape or ctrl-c
+          Exit = true;
+          break;
+        }
+        if (Key == 0x0d) {
+          Key = '#'; // SAM-BA uses # as EOL character for some unknown reason
+        }
+        Keys[Length++] = Key;
         if ((Key > 0x1f) && (Key < 0x7f)) {
-          write( FileNumberConsole, &Key, sizeof( Key));
-    } } }
-    while (FileInputAvailable( FileNumberSam9)) {
-      Key = FileGetCharacter( FileNumberSam9);
-      write( FileNumberConsole, &Key, sizeof( Key));
-      Key = 0;
-    }
-  } while ((Key != 0x1b) && (Key != 0x03)); // escape or ctrl-c
+          Echo[EchoLength++] = Key;
+      } }
+      FileWriteBlock( Session->FileNumber, Keys, Length);
+      FileWriteBlock( FileNumberConsole, Echo, EchoLength);
+    }
+    if (pfd[1].revents) {
+      if ((Sam9ReadAvailable( Session) == 0) && (pfd[1].revents & (POLLHUP | POLLERR))) {
+        break; // serial port gone
+  } } }
+  TerminalOutput( Session);
   ConsoleResetRawMode();
   printf( "\n[[ exit terminal mode ]]\n");
 }
@@ -236,7 +295,7 @@ static bit32 NumericValue( ccptr String) {
     if (String[0] == '$') {
       sscanf( String+1, "%x", &Value);
     } else {
-      if ((String[0] == '0') && strchr( "Xx", String[1])) {
+      if ((String[0] == '0') && String[1] && strchr( "Xx", String[1])) {
         sscanf( String+2, "%x", &Value);
       } else {
         sscanf( String, "%d", &Value);
@@ -253,26 +312,50 @@ static void ShowHelp( ccptr ExecutableName) {
   printf( "Utility to simplify dealing with the SAM9 RomBOOT facility via a serial interface.\n");
   printf( "\n");
   printf( "Usage:  %s\n", ExecutableName);
-  printf( "           {-p=port}\n");
+  printf( "           {-p=port} {-b=rate} {-u=rate {-m=mck}}\n");
   printf( "              {-f=filename {-a=address} {-n=bytes {-r} {-d}} {-s}}\n");
-  printf( "                  {-j{=address} -g} {-c} {-v} {-q} {-t} {-i}\n");
+  printf( "                  {-j{=address} -g} {-c} {-v} {-q} {-t} {-i} {-x=blocksize} {-w=window} {-e}\n");
   printf( "\n");
   printf( "Where:\n");
   printf( "\n");
   printf( "   -p=port  . . . . . . . . port to communicate with RomBOOT (default /dev/ttyUSB0)\n");
-  printf( "   -f=filename  . . . . . . filename (needed by -r and -s)\n");
+  printf( "                            repeat -p or use a glob (-p='/dev/ttyUSB*') for several\n");
+  printf( "   -b=rate  . . . . . . . . serial rate, standard or not (default 115200)\n");
+  printf( "   -u=rate  . . . . . . . . switch the target DBGU to this rate after the handshake\n");
+  printf( "   -m=mck . . . . . . . . . master clock in Hz for -u (default estimated from DBGU)\n");
+  printf( "   -f=filename  . . . . . . filename (needed by -r and -s, - for stdin)\n");
   printf( "   -a=address . . . . . . . address (default 0x300000, used by -r, -d and -s)\n");
   printf( "   -n=bytes . . . . . . . . number of bytes (defaults to filesize for -s)\n");
   printf( "   -r . . . . . . . . . . . receive file (also specify -f, -a and -n)\n");
   printf( "   -d . . . . . . . . . . . dump memory (also specify -a and -n or -s)\n");
   printf( "   -s . . . . . . . . . . . send file (also specify -f and -a)\n");
-  printf( "   -j{=address} . . . . . . address to jump to (default -a)\n");
+  printf( "   -j{=address} . . . . . . address to jump to (default -a, or the file's entry point)\n");
   printf( "   -g . . . . . . . . . . . go/start execution (also specify -j) \n");
   printf( "   -c . . . . . . . . . . . query cpu part id\n");
   printf( "   -v . . . . . . . . . . . verify memory against file (also specify -f)\n");
   printf( "   -q . . . . . . . . . . . quiet (no non-essential i/o or messages)\n");
   printf( "   -t . . . . . . . . . . . trace details of upload/verify activity\n");
   printf( "   -i . . . . . . . . . . . interactive (terminal) mode\n");
+  printf( "   -x=blocksize . . . . . . XMODEM block size for -s (128 default, 1024, or 0 for word mode)\n");
+  printf( "   -w=window  . . . . . . . word commands kept in flight (8 default, 1 for stop-and-wait)\n");
+  printf( "   -e . . . . . . . . . . . stay in echoing terminal mode (no SAM-BA 'N#' binary mode)\n");
+  printf( "   --daemon{=socket}  . . . serve flash jobs on a Unix socket (default " DAEMON_SOCKET ")\n");
+  printf( "   --submit{=socket}  . . . send the -f, -a, -n, -j, -v and -p job to a daemon\n");
+  printf( "   --server{=socket}  . . . keep a session open on -p and serve requests on a socket\n");
+  printf( "                            (default " SERVER_SOCKET ")\n");
+  printf( "   --connect{=socket} . . . send -c, --peek, --poke, -d and -j requests to a server\n");
+  printf( "   --peek=address{,size}  . read a word (or size 1 or 2) through the server\n");
+  printf( "   --poke=address,value{,size}  write a word (or size 1 or 2) through the server\n");
+  printf( "   --async  . . . . . . . . drive every port from one thread with coroutines\n");
+  printf( "   --uring  . . . . . . . . move serial traffic through io_uring (Linux 5.11+)\n");
+  printf( "   --bench  . . . . . . . . run -s/-v with both transports and compare system calls\n");
+  printf( "   --delta  . . . . . . . . send only the -s blocks that differ from target memory\n");
+  printf( "   --crc  . . . . . . . . . verify -v with a CRC32 computed on the target\n");
+  printf( "   --sparse . . . . . . . . fill -s runs of 0x00 or 0xff on the target, not sent\n");
+  printf( "   --compress . . . . . . . send -s LZ4 compressed and expand it on the target\n");
+  printf( "   --resume . . . . . . . . carry on an interrupted -s or -r where it stopped\n");
+  printf( "   --stage=address  . . . . where --compress stages its data (default after -s file)\n");
+  printf( "   --applet=address . . . . spare SRAM for target routines (default 0x305000, 4 KB)\n");
   printf( "\n");
   printf( "All parameters are additive.  Relative order only matters for -a and -j.  Numeric\n");
   printf( "values may be entered as decimal (no prefix) or as hex with either 0x or $ prefix.\n");
@@ -281,9 +364,91 @@ static void ShowHelp( ccptr ExecutableName) {
   printf( "is specified without -i execution is automatic.  If -i is also specified, then it\n");
   printf( "enters the SAM-BA 'go' command without executing it so you may do so manually via\n");
   printf( "the terminal interface.  To force automatic execution in -i mode also specify -g.\n");
+  printf( "Files are sent with the RomBOOT XMODEM 'S' command, any trailing partial block is\n");
+  printf( "sent word-at-a-time.  If XMODEM fails the whole file is resent word-at-a-time.\n");
+  printf( "An ELF32 ARM file is sent one PT_LOAD segment at a time to its physical address\n");
+  printf( "(-a and -n do not apply), with .bss zero-filled on the target rather than sent.\n");
+  printf( "Intel HEX and S-record files are likewise sent one contiguous region at a time,\n");
+  printf( "a bare -j jumps to the start address record (or the first region).\n");
+  printf( "With -f=- (or a pipe) the image is read from stdin as it is sent, %d KB at a\n", STREAM_CHUNK / 1024);
+  printf( "time, and -v compares CRC32s as the data itself is gone.\n");
+  printf( "Memory for -r, -d and -v is read with the XMODEM 'R' command when -n is at least\n");
+  printf( "%d bytes, and word-at-a-time otherwise.  Specify -x=0 to use words for both.\n", XMODEM_MINIMUM);
+  printf( "-r writes the file as the memory arrives, a failed -r leaves what it has with\n");
+  printf( "the ranges received listed in the file name plus '" RECEIVE_INDEX "'.\n");
+  printf( "After the handshake RomBOOT is switched to non-interactive 'N#' mode so commands\n");
+  printf( "are not echoed and reads return binary values.  It is switched back with 'T#'\n");
+  printf( "before -i or when exiting without a jump.  With -u the DBGU and port are moved\n");
+  printf( "to the faster rate for the transfers and back to the -b rate before -j or -i.\n");
+  printf( "With several ports each is flashed from its own thread with the same file image\n");
+  printf( "and parameters, then a pass/fail table and the aggregate throughput are shown.\n");
+  printf( "Parameters -r, -d, -i and -t need a single port.  With --daemon every port given\n");
+  printf( "by -p (default all /dev/ttyUSB* and /dev/ttyACM*) gets a worker, jobs go to the\n");
+  printf( "least loaded port and idle ports take queued jobs from busy ones.  A job with -p\n");
+  printf( "only runs on that port.  File images are cached until the file changes.  With\n");
+  printf( "--server the handshake is done once and clients are served one at a time, in\n");
+  printf( "the order -c, --peek and --poke as given, -d, then the -j jump.  With --async\n");
+  printf( "the ports share one thread and event loop instead of a thread each, this needs\n");
+  printf( "binary mode and does -c, -s, -v and -j only (no -r, -d, -i, -t, -u or -e).\n");
+  printf( "With --uring each session queues its commands and submits them together with\n");
+  printf( "the wait for the reply, a read into the serial buffer is always outstanding.\n");
+  printf( "--bench repeats the job on every port with each transport and shows the serial\n");
+  printf( "system calls made per KB moved.\n");
+  printf( "With --delta a CRC32 routine is uploaded to the --applet area and run with 'G'\n");
+  printf( "to checksum the target memory in 1 KB blocks (larger past 512 KB), and only the\n");
+  printf( "runs of blocks whose checksums differ from the file are sent.  The applet area\n");
+  printf( "must not overlap the file, the default suits the SAM9X25's 32 KB SRAM.  With\n");
+  printf( "--crc the same routine checks -v with one CRC32 of the whole range, memory is\n");
+  printf( "only read back to find the first difference when the CRC32 disagrees.  With\n");
+  printf( "--sparse runs of at least %d bytes of 0x00 or 0xff (whole %d-byte blocks) are\n", SPARSE_RUN, SPARSE_CHUNK);
+  printf( "written by a fill routine in the --applet area, the rest of the file is sent.\n");
+  printf( "With --compress the file is LZ4 compressed in %d KB pieces while earlier pieces\n", COMPRESS_CHUNK / 1024);
+  printf( "are sent to the --stage area, then expanded to -a and checked by CRC32.\n");
+  printf( "-s with --resume sends %d KB at a time and notes its progress after each piece\n", RESUME_CHUNK / 1024);
+  printf( "in a journal (" RESUME_JOURNAL "-port-crc-address), -r in its index.  A later\n");
+  printf( "--resume with the same port, file and address checks the last piece done by\n");
+  printf( "CRC32 (or by reading back its last KB) and carries on after it.\n");
   printf( "\n");
 }
 
+// ----------------------------------------------------------------------------
+//  Add a port name to the list, or every device matching it if it contains
+//  wildcards.  Names already in the list are skipped so that overlapping
+//  patterns do not open a port twice.
+// ----------------------------------------------------------------------------
+
+static bool AddPort( ccptr Name) {
+  for (int i = 0; i < PortCount; i++) {
+    if (strcmp( PortNames[i], Name) == 0) {
+      return true;
+  } }
+  if (PortCount == PORTS_MAX) {
+    printf( "*** Too many ports (%d maximum)!\n", PORTS_MAX);
+    return false;
+  }
+  PortNames[PortCount++] = Name;
+  return true;
+}
+
+static bool ExpandPorts( ccptr Pattern, bool Required) {
+  if (strpbrk( Pattern, "*?[") == NULL) {
+    return AddPort( Pattern);
+  }
+  glob_t Matches;
+  if (glob( Pattern, 0, NULL, &Matches)) {
+    if (Required) {
+      printf( "*** No ports match '-p=%s'!\n", Pattern);
+    }
+    return false;
+  }
+  bool Success = true;
+  for (size_t i = 0; Success && (i < Matches.gl_pathc); i++) {
+    Success = AddPort( strdup( Matches.gl_pathv[i]));
+  }
+  globfree( &Matches);
+  return Success;
+}
+
 // ----------------------------------------------------------------------------
 //  Parse the command line and extract parameters.  See ShowHelp() above for
 //  the list of valid parameters and co-dependencies.  Check for missing
@@ -298,15 +463,27 @@ static bool ParseParameters( int argc, ccptr argv[]) {
       Success = false;
     } else {
       switch( x[1]) {
-        case 'p': case 'f': case 'a': case 'n': case 'j':
+        case 'p': case 'f': case 'a': case 'n': case 'j': case 'x': case 'w': case 'b': case 'u': case 'm':
           if (strlen( x) > 3) {
             if (x[2] == '=') {
               switch( x[1]) { // parameters with arguments
-                case 'p': ParamPort      = x+3; break;
+                case 'p':
+                  if (ParamPortCount == PORTS_MAX) {
+                    printf( "*** Too many ports (%d maximum)!\n", PORTS_MAX);
+                    return false;
+                  }
+                  ParamPorts[ParamPortCount++] = ParamPort = x+3;
+                  FlagPortGiven = true;
+                  break;
                 case 'f': ParamFileName  = x+3; break;
                 case 'a': ParamAddrStart = x+3; break;
                 case 'n': ParamBytes     = x+3; break;
                 case 'j': ParamAddrJump    = x+3; break;
+                case 'x': ParamXmodem    = x+3; break;
+                case 'w': ParamWindow    = x+3; break;
+                case 'b': ParamBaud      = x+3; break;
+                case 'u': ParamTurbo     = x+3; break;
+                case 'm': ParamMck       = x+3; break;
               }
             } else {
               Success = false;
@@ -314,11 +491,12 @@ static bool ParseParameters( int argc, ccptr argv[]) {
           } else {
             if ((x[1] == 'j') && (strlen( x) == 2)) {
               ParamAddrJump = ParamAddrStart;
+              FlagJumpDefault = true;
             } else {
               Success = false;
           } }
           break;
-        case 'r': case 'd': case 's': case 'c': case 'v': case 'q': case 't': case 'i': case 'g':
+        case 'r': case 'd': case 's': case 'c': case 'v': case 'q': case 't': case 'i': case 'g': case 'e':
           switch( x[1]) { // simple switch parameters
             case 'r': FlagReceive     = true; break;
             case 'd': FlagDump        = true; break;
@@ -329,10 +507,52 @@ static bool ParseParameters( int argc, ccptr argv[]) {
             case 't': FlagTrace       = true; break;
             case 'i': FlagInteractive = true; break;
             case 'g': FlagGo          = true; break;
+            case 'e': FlagEcho        = true; break;
             default:
               Success = false;
           }
           break;
+        case '-': // long options
+          if ((strcmp( x, "--daemon") == 0) || (strncmp( x, "--daemon=", 9) == 0)) {
+            ParamDaemon = x[8] ? x+9 : DAEMON_SOCKET;
+          } else if ((strcmp( x, "--submit") == 0) || (strncmp( x, "--submit=", 9) == 0)) {
+            ParamSubmit = x[8] ? x+9 : DAEMON_SOCKET;
+          } else if ((strcmp( x, "--server") == 0) || (strncmp( x, "--server=", 9) == 0)) {
+            ParamServer = x[8] ? x+9 : SERVER_SOCKET;
+          } else if ((strcmp( x, "--connect") == 0) || (strncmp( x, "--connect=", 10) == 0)) {
+            ParamConnect = x[9] ? x+10 : SERVER_SOCKET;
+          } else if (strcmp( x, "--async") == 0) {
+            FlagAsync = true;
+          } else if (strcmp( x, "--uring") == 0) {
+            FlagUring = true;
+          } else if (strcmp( x, "--bench") == 0) {
+            FlagBench = true;
+          } else if (strcmp( x, "--delta") == 0) {
+            FlagDelta = true;
+          } else if (strcmp( x, "--crc") == 0) {
+            FlagCrc = true;
+          } else if (strcmp( x, "--sparse") == 0) {
+            FlagSparse = true;
+          } else if (strcmp( x, "--compress") == 0) {
+            FlagCompress = true;
+          } else if (strcmp( x, "--resume") == 0) {
+            FlagResume = true;
+          } else if ((strncmp( x, "--applet=", 9) == 0) && x[9]) {
+            ParamApplet = x+9;
+          } else if ((strncmp( x, "--stage=", 8) == 0) && x[8]) {
+            ParamStage = x+8;
+          } else if (((strncmp( x, "--peek=", 7) == 0) || (strncmp( x, "--poke=", 7) == 0)) && x[7]) {
+            if (ServerRequestCount == REQUESTS_MAX) {
+              printf( "*** Too many requests (%d maximum)!\n", REQUESTS_MAX);
+              return false;
+            }
+            cptr Request = (cptr) malloc( strlen( x));
+            sprintf( Request, "%4.4s %s", x+2, x+7);
+            ServerRequests[ServerRequestCount++] = Request;
+          } else {
+            Success = false;
+          }
+          break;
         default:
           Success = false;
     } }
@@ -340,8 +560,89 @@ static bool ParseParameters( int argc, ccptr argv[]) {
       printf( "*** Invalid parameter: '%s'\n", x);
       return false;
   } }
-  if (strncmp( ParamPort, "/dev/", 5)) {
-    printf( "*** Invalid parameter: '-p=%s'\n", ParamPort);
+  if (ParamDaemon && ParamSubmit) {
+    printf( "*** Parameters '--daemon' and '--submit' may not both be specified!\n");
+    return false;
+  }
+  if ((ParamServer || ParamConnect) && (ParamDaemon || ParamSubmit || (ParamServer && ParamConnect))) {
+    printf( "*** Parameters '--daemon', '--submit', '--server' and '--connect' are exclusive!\n");
+    return false;
+  }
+  if (ParamServer && (FlagSend || FlagReceive || FlagVerify || FlagInteractive)) {
+    printf( "*** Parameters '-s', '-r', '-v' and '-i' may not be used with '--server'!\n");
+    return false;
+  }
+  if (FlagAsync && (ParamDaemon || ParamSubmit || ParamServer || ParamConnect)) {
+    printf( "*** Parameter '--async' may not be used with '--daemon', '--submit', '--server' or '--connect'!\n");
+    return false;
+  }
+  if (FlagAsync && (FlagReceive || FlagDump || FlagInteractive || FlagTrace || ParamTurbo || FlagEcho)) {
+    printf( "*** Parameters '-r', '-d', '-i', '-t', '-u' and '-e' may not be used with '--async'!\n");
+    return false;
+  }
+  if ((FlagUring || FlagBench) && (FlagAsync || FlagInteractive)) {
+    printf( "*** Parameters '--uring' and '--bench' may not be used with '--async' or '-i'!\n");
+    return false;
+  }
+  if (FlagBench && (ParamDaemon || ParamSubmit || ParamServer || ParamConnect || ParamAddrJump || ((FlagSend || FlagVerify) == false))) {
+    printf( "*** Parameter '--bench' needs '-s' or '-v' and no '-j', '--daemon', '--server' or '--connect'!\n");
+    return false;
+  }
+  if (((FlagDelta || FlagSparse || FlagCompress) && (FlagSend == false)) || (FlagCrc && (FlagVerify == false))) {
+    printf( "*** Parameters '--delta', '--sparse' and '--compress' need '-s', '--crc' needs '-v'!\n");
+    return false;
+  }
+  if (FlagDelta + FlagSparse + FlagCompress > 1) {
+    printf( "*** Parameters '--delta', '--sparse' and '--compress' are exclusive!\n");
+    return false;
+  }
+  if (FlagResume && (((FlagSend || FlagReceive) == false) || FlagDelta || FlagSparse || FlagCompress)) {
+    printf( "*** Parameter '--resume' needs '-s' or '-r' and no '--delta', '--sparse' or '--compress'!\n");
+    return false;
+  }
+  if ((FlagDelta || FlagSparse || FlagCompress || FlagCrc || FlagResume) && (FlagAsync || FlagBench || ParamDaemon || ParamSubmit || ParamServer || ParamConnect)) {
+    printf( "*** Parameters '--delta', '--sparse', '--compress', '--crc' and '--resume' may not be used with '--async', '--bench', '--daemon', '--server' or '--connect'!\n");
+    return false;
+  }
+  if (ServerRequestCount && (ParamConnect == NULL)) {
+    printf( "*** Parameters '--peek' and '--poke' require '--connect'!\n");
+    return false;
+  }
+  if (ParamConnect && FlagDump && (ParamBytes == NULL)) {
+    printf( "*** Parameter '-d' requires '-n'!\n");
+    return false;
+  }
+  if (ParamSubmit && (ParamFileName == NULL)) {
+    printf( "*** Parameter '--submit' requires '-f'!\n");
+    return false;
+  }
+  if (ParamDaemon && (ParamPortCount == 0)) {
+    ExpandPorts( "/dev/ttyUSB*", false);
+    ExpandPorts( "/dev/ttyACM*", false);
+    if (PortCount == 0) {
+      printf( "*** No /dev/ttyUSB* or /dev/ttyACM* ports found for '--daemon'!\n");
+      return false;
+  } }
+  if ((ParamPortCount == 0) && (PortCount == 0)) {
+    ParamPorts[ParamPortCount++] = ParamPort;
+  }
+  for (int n = 0; n < ParamPortCount; n++) {
+    if (strncmp( ParamPorts[n], "/dev/", 5)) {
+      printf( "*** Invalid parameter: '-p=%s'\n", ParamPorts[n]);
+      return false;
+    }
+    if (ParamSubmit || ParamConnect) {
+      continue; // the daemon or server owns the ports
+    }
+    if (ExpandPorts( ParamPorts[n], true) == false) {
+      return false;
+  } }
+  if (ParamServer && (PortCount > 1)) {
+    printf( "*** Parameter '--server' needs a single port!\n");
+    return false;
+  }
+  if (((PortCount > 1) || ParamDaemon) && (FlagReceive || FlagDump || FlagInteractive || FlagTrace)) {
+    printf( "*** Parameters '-r', '-d', '-i' and '-t' need a single port!\n");
     return false;
   }
   if ((FlagReceive || FlagSend) && (ParamFileName == NULL)) {
@@ -368,292 +669,1881 @@ static bool ParseParameters( int argc, ccptr argv[]) {
       printf( "*** Invalid parameter: '-n=%s'\n", ParamBytes);
       return false;
   } }
+  if (ParamXmodem) {
+    ValueXmodem = NumericValue( ParamXmodem);
+    if ((ValueXmodem != 0) && (ValueXmodem != 128) && (ValueXmodem != 1024)) {
+      printf( "*** Invalid parameter: '-x=%s'\n", ParamXmodem);
+      return false;
+  } }
+  if (ParamWindow) {
+    ValueWindow = NumericValue( ParamWindow);
+    if ((ValueWindow < 1) || (ValueWindow > 256)) {
+      printf( "*** Invalid parameter: '-w=%s'\n", ParamWindow);
+      return false;
+  } }
+  if (ParamBaud) {
+    ValueBaud = NumericValue( ParamBaud);
+    if ((ValueBaud < 300) || (ValueBaud > 12000000)) {
+      printf( "*** Invalid parameter: '-b=%s'\n", ParamBaud);
+      return false;
+  } }
+  if (ParamTurbo) {
+    ValueTurbo = NumericValue( ParamTurbo);
+    if ((ValueTurbo < 300) || (ValueTurbo > 12000000)) {
+      printf( "*** Invalid parameter: '-u=%s'\n", ParamTurbo);
+      return false;
+  } }
+  if (ParamMck) {
+    ValueMck = NumericValue( ParamMck);
+    if (ValueMck < 1000000) {
+      printf( "*** Invalid parameter: '-m=%s'\n", ParamMck);
+      return false;
+  } }
+  if (ParamApplet) {
+    ValueApplet = NumericValue( ParamApplet);
+    if (ValueApplet & 3) {
+      printf( "*** Invalid parameter: '--applet=%s'\n", ParamApplet);
+      return false;
+  } }
+  if (ParamStage) {
+    ValueStage = NumericValue( ParamStage);
+    if ((ValueStage == 0) || (ValueStage & 3)) {
+      printf( "*** Invalid parameter: '--stage=%s'\n", ParamStage);
+      return false;
+  } }
   return true;
 }
 
 // ----------------------------------------------------------------------------
-//  Load a sam9 memory image into a dynamically-allocated buffer.
+//  Map a file image from disk.  If Bytes is zero the whole file is mapped,
+//  otherwise exactly that many bytes, zero-padded past the end of the file.
+//  Nothing is read up front: pages come in as the send reaches them, with
+//  read-ahead from MADV_SEQUENTIAL, and being clean file pages they can be
+//  dropped again under memory pressure, so a large image costs no more RAM
+//  than a small one.  Release the image with UnloadImage().
 // ----------------------------------------------------------------------------
 
-static bit32 MemoryCount = 0;
-static bptr MemoryBuffer = NULL;
-
-static bool LoadMemory( fptr FileHandleSam9, bit32 StartAddress, bit32 Count) {
-  if (MemoryBuffer = (bptr) calloc( Count, 1)) {
-    bit32 Address = StartAddress, Length = 0, Value;
-    bit32 Chunk = ValueBytes > 3 ? 4 : 1;
-    while (Length < Count) {
-      switch (Chunk) {
-        case 1:
-          fprintf( FileHandleSam9, "o%5.5X,1#\n", Address);
-          if (FlagTrace) {
-            printf( "o%5.5X,1#", Address);
-          }
-          break;
-        case 4:
-          fprintf( FileHandleSam9, "w%5.5X,4#\n", Address);
-          if (FlagTrace) {
-            printf( "w%5.5X,4#", Address);
-          }
-          break;
-      }
-      Value = GetResponse( FileNumberSam9, FlagTrace);
-      if (ResponseCount) {
-        for (int n = 0; n < Chunk; n++) {
-          MemoryBuffer[MemoryCount++] = Value & 0xff;
-          Value >>= 8;
-        }
-        if ((Length % 256) == 0) {
-          printf( "Downloading memory from $%x (%d bytes)...\r", StartAddress, Length);
-          fflush( stdout);
-        }
-        Address += Chunk;
-        Length += Chunk;
-        if (Count - Length < 4) {
-          Chunk = 1;
-        }
-      } else {
-        fprintf( stderr, "*** Failed to download memory from $%x (%d bytes, %d expected, target unresponsive)!\n", StartAddress, MemoryCount, Count);
-        return false;
-    } }
-    if (MemoryCount == Count) {
+static bool LoadImage( ccptr FileName, bit32 Bytes, bptr &Buffer, bit32 &Count) {
+  struct stat Status;
+  int File = open( FileName, O_RDONLY);
+  if ((File < 0) || (fstat( File, &Status) < 0)) {
+    fprintf( stderr, "*** Failed to load file '%s' (open error)!\n", FileName);
+  } else if (Status.st_size == 0) {
+    fprintf( stderr, "*** Failed to load file '%s' (zero length)!\n", FileName);
+  } else {
+    bit32 FileBytes = Status.st_size;
+    if (Bytes == 0) {
+      Bytes = FileBytes;
+    }
+    void *Map = mmap( NULL, Bytes, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ((Map != MAP_FAILED) && (mmap( Map, (FileBytes < Bytes) ? FileBytes : Bytes, PROT_READ, MAP_PRIVATE | MAP_FIXED, File, 0) == MAP_FAILED)) {
+      munmap( Map, Bytes);
+      Map = MAP_FAILED;
+    }
+    if (Map != MAP_FAILED) {
+      madvise( Map, Bytes, MADV_SEQUENTIAL);
+      close( File);
+      Buffer = (bptr) Map;
+      Count = Bytes;
       return true;
     }
-    fprintf( stderr, "*** Failed to download memory from $%x (%d bytes, %d expected)!\n", StartAddress, MemoryCount, Count);
-  } else {
-    fprintf( stderr, "*** Failed to download memory from $%x (%d bytes, calloc error)!\n", StartAddress, Count);
+    fprintf( stderr, "*** Failed to load file '%s' (%d bytes, mmap error)!\n", FileName, Bytes);
+  }
+  if (File >= 0) {
+    close( File);
   }
   return false;
 }
 
-// ----------------------------------------------------------------------------
-//  Load a file image from disk into a dynamically-allocated buffer.
-// ----------------------------------------------------------------------------
+static void UnloadImage( bptr &Buffer, bit32 Count) {
+  if (Buffer) {
+    munmap( Buffer, Count);
+    Buffer = NULL;
+} }
 
 static bit32 FileCount = 0;
 static bptr FileBuffer = NULL;
 
-static bool LoadFile( ccptr FileName) {
-  if (fptr f = fopen( FileName, "rb")) {
-    bit32 FileBytes = 0;
-    fseek( f, 0, SEEK_END);
-    if (FileBytes = ftell( f)) {
-      rewind( f);
-      if (ValueBytes == 0) {
-        ValueBytes = FileBytes;
-      }
-      if (FileBuffer = (bptr) calloc( ValueBytes, 1)) {
-        if (fread( FileBuffer, 1, ValueBytes, f) == ValueBytes) {
-          fclose( f);
-          return true;
-        }
-        fprintf( stderr, "*** Failed to load file '%s' (%d bytes, read error)!\n", FileName, ValueBytes);
-      } else {
-        fprintf( stderr, "*** Failed to load file '%s' (%d bytes, calloc error)!\n", FileName, ValueBytes);
-      }
-    } else {
-      fprintf( stderr, "*** Failed to load file '%s' (zero length)!\n", FileName);
-    }
-    fclose( f);
-  } else {
+// ----------------------------------------------------------------------------
+//  Load an ELF32 ARM executable.  The file is mapped and each PT_LOAD
+//  program header becomes a segment at its physical address, the part of
+//  the segment beyond the file data (.bss) is zero-filled on the target.
+//  ValueAddrStart and ValueBytes become the first address and the total of
+//  the file data, for messages and -d.
+// ----------------------------------------------------------------------------
+
+#define SEGMENTS_MAX 256
+
+static Sam9Segment FileSegments[SEGMENTS_MAX];
+static int FileSegmentCount = 0;
+static bit32 FileEntry = 0;
+static ccptr FileFormat = NULL;
+
+static bool LoadElf( ccptr FileName) {
+  struct stat Status;
+  int File = open( FileName, O_RDONLY);
+  if ((File < 0) || (fstat( File, &Status) < 0)) {
     fprintf( stderr, "*** Failed to load file '%s' (open error)!\n", FileName);
+    return false;
   }
-  return false;
+  bit32 Size = Status.st_size;
+  const byte *Map = (const byte *) mmap( NULL, Size, PROT_READ, MAP_PRIVATE, File, 0);
+  close( File);
+  if (Map == MAP_FAILED) {
+    fprintf( stderr, "*** Failed to load file '%s' (mmap error)!\n", FileName);
+    return false;
+  }
+  Elf32_Ehdr Header;
+  char Problem[80] = "";
+  memcpy( &Header, Map, (Size < sizeof( Header)) ? Size : sizeof( Header));
+  if ((Size < sizeof( Header)) || (Header.e_ident[EI_CLASS] != ELFCLASS32) || (Header.e_ident[EI_DATA] != ELFDATA2LSB) || (Header.e_machine != EM_ARM)
+   || (Header.e_phentsize != sizeof( Elf32_Phdr)) || (Header.e_phoff > Size) || (Header.e_phnum > (Size - Header.e_phoff) / sizeof( Elf32_Phdr))) {
+    snprintf( Problem, sizeof( Problem), "not a little-endian ELF32 ARM file");
+  }
+  ValueBytes = 0;
+  for (int i = 0; (Problem[0] == 0) && (i < Header.e_phnum); i++) {
+    Elf32_Phdr Program;
+    memcpy( &Program, Map + Header.e_phoff + i * sizeof( Elf32_Phdr), sizeof( Program));
+    if ((Program.p_type != PT_LOAD) || (Program.p_memsz == 0)) {
+      continue;
+    }
+    if ((Program.p_filesz > Program.p_memsz) || (Program.p_offset > Size) || (Program.p_filesz > Size - Program.p_offset)) {
+      snprintf( Problem, sizeof( Problem), "program header %d is damaged", i);
+    } else if (FileSegmentCount == SEGMENTS_MAX) {
+      snprintf( Problem, sizeof( Problem), "more than %d segments", SEGMENTS_MAX);
+    } else {
+      FileSegments[FileSegmentCount++] = { Program.p_paddr, Map + Program.p_offset, Program.p_filesz, Program.p_memsz - Program.p_filesz };
+      ValueBytes += Program.p_filesz;
+  } }
+  if ((Problem[0] == 0) && (FileSegmentCount == 0)) {
+    snprintf( Problem, sizeof( Problem), "no loadable segments");
+  }
+  if (Problem[0]) {
+    fprintf( stderr, "*** Failed to load file '%s' (%s)!\n", FileName, Problem);
+    munmap( (void *) Map, Size);
+    FileSegmentCount = 0;
+    return false;
+  }
+  ValueAddrStart = FileSegments[0].Address;
+  FileEntry = Header.e_entry;
+  return true;
 }
 
 // ----------------------------------------------------------------------------
-//  Main application.
+//  Load an Intel HEX or Motorola S-record file in one pass, a line at a
+//  time.  Data records extend the current run while their addresses follow
+//  on, anything else starts a new one.  The runs are then sorted by address
+//  and adjacent ones merged into the segments, with their data copied into
+//  FileBuffer in address order.  The start address record, if any, is the
+//  entry point, otherwise the first segment's address.
 // ----------------------------------------------------------------------------
 
-int main( int argc, ccptr argv[]) {
-  printf( "\nSAM9 Boot Utility Version " VERSION "\n");
-  bool Success = true;
-  if (argc > 1) {
-    if (ParseParameters( argc, argv)) {
-      printf( "\n");
-      if (fptr FileHandleSam9 = fopen( ParamPort, "a+b")) {
-        FileNumberConsole = fileno( stdin);
-        FileNumberSam9 = fileno( FileHandleSam9);
-        Sam9SetSerialMode();
-        fprintf( FileHandleSam9, "#\n");
-        if (FlagQuiet == false) {
-          printf( "#");
-        }
-        GetResponse( FileNumberSam9, FlagQuiet ? false : true);
-        if (FlagQuiet == false) {
-          fprintf( FileHandleSam9, "V#\n");
-          printf( "V#");
-          GetResponse( FileNumberSam9);
-        }
+#define HEX_LINE 600 // longest record line, with room to spare
 
-        //-------
-        //  cpu
-        //-------
+struct HexRun {
+  bit32  Address;
+  bit32  Offset;                      // of the data in the parse buffer
+  bit32  Bytes;
+};
 
-        if (FlagCpu) {
-          fprintf( FileHandleSam9, "wfffff240,4#\n");
-          printf( "wfffff240,4#");
-          bit32 PartId = GetResponse( FileNumberSam9);
-          if (ResponseCount) {
-            printf( "PartId = $%8.8X\n", PartId);
-          } else {
-            fflush( stdout);
-            fprintf( stderr, "\n*** Failed to get cpu type (target unresponsive)!");
-            fflush( stderr);
-            Success = false;
-        } }
-        GetResponse( FileNumberSam9);
-        printf( "\n");
+static int HexRunCompare( const void *a, const void *b) {
+  bit32 x = ((const HexRun *) a)->Address, y = ((const HexRun *) b)->Address;
+  return (x < y) ? -1 : (x > y);
+}
 
-        //---------------------------------
-        //  send/verify - load file image
-        //---------------------------------
+static int HexDecode( ccptr Text, byte *Bytes) {
+  int Count = 0;
+  while (isxdigit( Text[0]) && isxdigit( Text[1])) {
+    char Pair[3] = { Text[0], Text[1], 0 };
+    Bytes[Count++] = strtoul( Pair, NULL, 16);
+    Text += 2;
+  }
+  return ((*Text == 0) || (*Text == '\r') || (*Text == '\n')) ? Count : -1;
+}
 
-        if (Success && (FlagSend | FlagVerify)) {
-          if (ParamFileName) {
-            if (LoadFile( ParamFileName)) {
-              printf( "Loaded file '%s' (%d bytes) from disk.\n", ParamFileName, ValueBytes);
-            } else {
-              Success = false;
-            }
-          } else {
-            printf( "*** Parameters '-s' and '-v' require '-f'!\n");
-            Success = false;
-        } }
+static bool LoadHex( ccptr FileName, fptr f, bool Srecord) {
+  char Line[HEX_LINE];
+  byte Record[HEX_LINE / 2];
+  HexRun *Runs = NULL;
+  bptr Data = NULL;
+  bit32 RunCount = 0, RunLimit = 0, DataCount = 0, DataLimit = 0;
+  bit32 Base = 0, Entry = 0, Number = 0;
+  bool FlagEntry = false, FlagEnd = false;
+  ccptr Problem = NULL;
+  while ((Problem == NULL) && (FlagEnd == false) && fgets( Line, sizeof( Line), f)) {
+    Number++;
+    if ((Line[0] == '\r') || (Line[0] == '\n') || (Line[0] == 0)) {
+      continue;
+    }
+    int Count = HexDecode( Line + (Srecord ? 2 : 1), Record);
+    byte Sum = 0;
+    for (int i = 0; i < Count; i++) {
+      Sum += Record[i];
+    }
+    bit32 Address = 0, Length = 0;
+    const byte *Bytes = NULL;
+    if (Srecord) {
+      int Type = Line[1] - '0', Width = ((Type >= 1) && (Type <= 3)) ? Type + 1 : ((Type >= 7) && (Type <= 9)) ? 11 - Type : 2;
+      if ((Line[0] != 'S') || (Count < 1 + Width + 1) || (Record[0] != Count - 1) || (Type < 0) || (Type > 9) || (Sum != 0xff)) {
+        Problem = "bad record";
+        break;
+      }
+      for (int i = 0; i < Width; i++) {
+        Address = (Address << 8) | Record[1 + i];
+      }
+      if ((Type >= 1) && (Type <= 3)) {
+        Bytes = Record + 1 + Width;
+        Length = Count - 2 - Width;
+      } else if (Type >= 7) {
+        Entry = Address;
+        FlagEntry = FlagEnd = true;
+      }
+    } else {
+      if ((Line[0] != ':') || (Count < 5) || (Record[0] != Count - 5) || (Sum != 0)) {
+        Problem = "bad record";
+        break;
+      }
+      bit32 Value = (Count >= 7) ? (Record[4] << 8) | Record[5] : 0;
+      switch (Record[3]) {
+        case 0: Address = Base + ((Record[1] << 8) | Record[2]); Bytes = Record + 4; Length = Record[0]; break;
+        case 1: FlagEnd = true; break;
+        case 2: Base = Value << 4; break;
+        case 3: Entry = (Value << 4) + ((Record[6] << 8) | Record[7]); FlagEntry = true; break;
+        case 4: Base = Value << 16; break;
+        case 5: Entry = (Value << 16) | (Record[6] << 8) | Record[7]; FlagEntry = true; break;
+        default: Problem = "unknown record type";
+    } }
+    if (Length == 0) {
+      continue;
+    }
+    if ((DataCount + Length > DataLimit) && ((Data = (bptr) realloc( Data, DataLimit = 2 * (DataLimit + Length))) == NULL)) {
+      Problem = "realloc error";
+      break;
+    }
+    if ((RunCount == 0) || (Runs[RunCount-1].Address + Runs[RunCount-1].Bytes != Address)) {
+      if ((RunCount == RunLimit) && ((Runs = (HexRun *) realloc( Runs, (RunLimit = 2 * RunLimit + 16) * sizeof( HexRun))) == NULL)) {
+        Problem = "realloc error";
+        break;
+      }
+      Runs[RunCount++] = { Address, DataCount, 0 };
+    }
+    memcpy( Data + DataCount, Bytes, Length);
+    DataCount += Length;
+    Runs[RunCount-1].Bytes += Length;
+  }
+  if ((Problem == NULL) && (RunCount == 0)) {
+    Problem = "no data records";
+  }
+  if (Problem == NULL) {
+    qsort( Runs, RunCount, sizeof( HexRun), HexRunCompare);
+    if ((FileBuffer = (bptr) malloc( DataCount)) == NULL) {
+      Problem = "malloc error";
+  } }
+  ValueBytes = 0;
+  for (bit32 i = 0; (Problem == NULL) && (i < RunCount); i++) {
+    Sam9Segment *Last = FileSegmentCount ? &FileSegments[FileSegmentCount-1] : NULL;
+    if (Last && (Last->Address + Last->Bytes > Runs[i].Address)) {
+      Problem = "overlapping records";
+    } else if (Last && (Last->Address + Last->Bytes == Runs[i].Address)) {
+      Last->Bytes += Runs[i].Bytes;
+    } else if (FileSegmentCount == SEGMENTS_MAX) {
+      Problem = "too many segments";
+    } else {
+      FileSegments[FileSegmentCount++] = { Runs[i].Address, FileBuffer + ValueBytes, Runs[i].Bytes, 0 };
+    }
+    memcpy( FileBuffer + ValueBytes, Data + Runs[i].Offset, Runs[i].Bytes);
+    ValueBytes += Runs[i].Bytes;
+  }
+  free( Runs);
+  free( Data);
+  if (Problem) {
+    fprintf( stderr, "*** Failed to load file '%s' (%s at line %d)!\n", FileName, Problem, Number);
+    FileSegmentCount = 0;
+    return false;
+  }
+  ValueAddrStart = FileSegments[0].Address;
+  FileEntry = FlagEntry ? Entry : ValueAddrStart;
+  return true;
+}
 
-        //--------
-        //  send
-        //--------
-
-        if (Success && FlagSend) {
-          bit32 Address = ValueAddrStart, Length = 0;
-          int Chunk = ValueBytes > 3 ? 4 : 1;
-          while (Length < ValueBytes) {
-            bit32 Value = 0;
-            for (int i = 0; i < Chunk; i++) {
-              Value |= FileBuffer[Length++] << (i*8);
-            }
-            switch (Chunk) {
-              case 1:
-                fprintf( FileHandleSam9, "O%5.5X,%2.2X#\n", Address, Value);
-                if (FlagTrace) {
-                  printf( "O%5.5X,%2.2X#", Address, Value);
-                }
-                break;
-              case 4:
-                fprintf( FileHandleSam9, "W%5.5X,%8.8X#\n", Address, Value);
-                if (FlagTrace) {
-                  printf( "W%5.5X,%8.8X#", Address, Value);
-                }
-                break;
-            }
-            GetResponse( FileNumberSam9, FlagTrace);
-            Address += Chunk;
-            if ((Length % 256) == 0) {
-              printf( "Uploading file '%s' (%d bytes) to memory at $%x...\r", ParamFileName, Length, ValueAddrStart);
-              fflush( stdout);
-            }
-            if (ValueBytes - Length < 4) {
-              Chunk = 1;
-            }
-            Value = 0;
-          }
-          printf( "Uploaded file '%s' (%d bytes) to memory at $%x.    \n", ParamFileName, Length, ValueAddrStart);
-        }
+// ----------------------------------------------------------------------------
+//  Tell the -f file's format from its first bytes: "ELF", "Intel HEX",
+//  "S-record", or NULL for a flat binary image.
+// ----------------------------------------------------------------------------
 
-        //---------------------------------------
-        //  verify/recv/dump - load image buffer
-        //---------------------------------------
+static ccptr FileFormatOf( ccptr FileName) {
+  byte Magic[SELFMAG] = {};
+  if (fptr f = fopen( FileName, "rb")) {
+    fread( Magic, 1, SELFMAG, f);
+    fclose( f);
+  }
+  if (memcmp( Magic, ELFMAG, SELFMAG) == 0) {
+    return "ELF";
+  }
+  if ((Magic[0] == ':') && isxdigit( Magic[1]) && isxdigit( Magic[2])) {
+    return "Intel HEX";
+  }
+  if ((Magic[0] == 'S') && isdigit( Magic[1]) && isxdigit( Magic[2])) {
+    return "S-record";
+  }
+  return NULL;
+}
 
-        if (Success && (FlagVerify | FlagReceive | FlagDump)) {
-          if (ValueBytes) {
-            if (LoadMemory( FileHandleSam9, ValueAddrStart, ValueBytes)) {
-              printf( "Downloaded memory from $%x (%d bytes).\n", ValueAddrStart, ValueBytes);
-            } else {
-              Success = false;
-            }
-          } else {
-            printf( "*** Parameter '-d' requires '-n'!\n");
-            Success = false;
-        } }
+// ----------------------------------------------------------------------------
+//  Load the -f file: an ELF executable, an Intel HEX or S-record file, or a
+//  flat binary image.
+// ----------------------------------------------------------------------------
 
-        //-------------------------------
-        //  verify data in image buffer
-        //-------------------------------
-        if (Success && FlagVerify) {
-          if (ValueBytes) {
-            for (bit32 i = 0; Success && (i < ValueBytes); i++) {
-              if (FileBuffer[i] != MemoryBuffer[i]) {
-                fprintf( stderr, "*** Verify memory at $%x (%d bytes) error at offset %d!\n", ValueAddrStart, ValueBytes, i);
-                Success = false;
-            } }
-            if (Success) {
-              printf( "Verified memory at $%x (%d bytes).\n", ValueAddrStart, ValueBytes);
-            }
-          } else {
-            printf( "*** Parameter '-v' requires '-n'!\n");
-            Success = false;
-        } } 
+static bool LoadFile( ccptr FileName) {
+  if ((FileFormat = FileFormatOf( FileName)) == NULL) {
+    return LoadImage( FileName, ValueBytes, FileBuffer, ValueBytes);
+  }
+  if (strcmp( FileFormat, "ELF") == 0) {
+    return LoadElf( FileName);
+  }
+  fptr f = fopen( FileName, "rb");
+  bool Success = f && LoadHex( FileName, f, FileFormat[0] == 'S');
+  if (f) {
+    fclose( f);
+  }
+  return Success;
+}
 
-        //-----------------------------
-        //  recv data in image buffer
-        //-----------------------------
+// ----------------------------------------------------------------------------
+//  Check that segments stay clear of the applet area when an applet is
+//  needed after they have been sent (the applet would overwrite them).
+// ----------------------------------------------------------------------------
 
-        if (Success && FlagReceive && MemoryCount) {
-          if (fptr f = fopen( ParamFileName, "wb")) {
-            if (fwrite( MemoryBuffer, 1, MemoryCount, f) == MemoryCount) {
-              printf( "Wrote %d bytes to file '%s'.\n", MemoryCount, ParamFileName);
-            } else {
-              fprintf( stderr, "*** Error writing %d bytes to file '%s'!\n", MemoryCount, ParamFileName);
-              Success = false;
-            }
-            fclose( f);
-          } else {
-            fprintf( stderr, "*** Unable to open file '%s' for write!\n", ParamFileName);
-            Success = false;
-        } }
+static bool SegmentsClearOfApplet( void) {
+  if ((FlagCrc || FlagDelta || FlagSparse || FlagCompress) == false) {
+    return true;
+  }
+  for (int i = 0; i < FileSegmentCount; i++) {
+    bit32 End = FileSegments[i].Address + FileSegments[i].Bytes + FileSegments[i].Zero;
+    if ((FileSegments[i].Address < ValueApplet + APPLET_AREA) && (ValueApplet < End)) {
+      fprintf( stderr, "*** Applet area at $%x overlaps segment $%x-$%x, use --applet=address!\n", ValueApplet, FileSegments[i].Address, End - 1);
+      return false;
+  } }
+  return true;
+}
 
-        //-----------------------------
-        //  dump data in image buffer
-        //-----------------------------
+// ----------------------------------------------------------------------------
+//  Prepare a session for a port with the link settings from the command
+//  line.  Messages are prefixed with the port name when there are several.
+// ----------------------------------------------------------------------------
 
-        if (FlagDump && MemoryCount) {
-          printf( "\n");
-          bit32 Address = ValueAddrStart, Offset = 0;
-          char Template[66];
-          while (Offset < MemoryCount) {
-            for (int i = 0; i < sizeof( Template); i++) {
-              Template[i] = ' ';
-            }
-            Template[sizeof(Template)-1] = 0;
-            for (int i = 0, j = 0, k = 49; (i < 16) && (Offset < MemoryCount); i++) {
-              byte Value = MemoryBuffer[Offset++];
-              char Temp[16];
-              sprintf( Temp, "%2.2x", Value);
-              Template[j++] = Temp[0];
-              Template[j++] = Temp[1]; j++;
-              Template[k++] = ((Value > 0x1f) && (Value < 0x7f)) ? Value : '.';
-            }
-            printf( "$%6.6x  %s\n", Address, Template);
-            Address += 16;
-        } }
+static void SessionSetup( Sam9Session *Session, ccptr Port, bool Labelled) {
+  Session->Options.Baud = ValueBaud;
+  Session->Options.Turbo = ValueTurbo;
+  Session->Options.Mck = ValueMck;
+  Session->Options.Xmodem = ValueXmodem;
+  Session->Options.Window = ValueWindow;
+  Session->Options.Echo = FlagEcho;
+  Session->Options.Trace = FlagTrace;
+  Session->Options.Quiet = FlagQuiet;
+  Session->Options.Uring = FlagUring;
+  Session->Options.Applet = ValueApplet;
+  Session->Port = Port;
+  Session->Label = "";
+  if (Labelled) {
+    cptr Label = (cptr) malloc( strlen( Port) + 3);
+    sprintf( Label, "%s: ", Port);
+    Session->Label = Label;
+} }
 
-        //---------------------------------------------
-        //  interactive terminal mode w/optional 'go'
-        //---------------------------------------------
+// ----------------------------------------------------------------------------
+//  Files that cannot be mapped are streamed: stdin for -f=-, pipes, FIFOs
+//  and character devices.  A regular file redirected to stdin is mapped
+//  like any other.
+// ----------------------------------------------------------------------------
 
-        if (FlagInteractive) {
-          TerminalEmulator( FileHandleSam9);
-        } else {
-          if (Success && ParamAddrJump) {
-            fprintf( FileHandleSam9, "G%X#\n", ValueAddrJump);
-            printf( "G%X#\n", ValueAddrJump);
-            GetResponse( FileNumberSam9);
-        } }
-        fclose( FileHandleSam9);
-        printf( "\n");
+static bool FileIsStream( ccptr FileName) {
+  struct stat Status;
+  if (strcmp( FileName, "-") == 0) {
+    return (fstat( fileno( stdin), &Status) < 0) || (S_ISREG( Status.st_mode) == false);
+  }
+  return (stat( FileName, &Status) == 0) && (S_ISREG( Status.st_mode) == false);
+}
+
+// ----------------------------------------------------------------------------
+//  Thread body for the stream reader, filling the two buffers in turn.  As
+//  with a short file, -n past the end of the stream is padded with zeros.
+// ----------------------------------------------------------------------------
+
+static void *StreamReaderThread( void *Argument) {
+  Sam9Reader *Reader = (Sam9Reader *) Argument;
+  bool FlagEnd = false, FlagEof = false, Failed = false;
+  for (int i = 0; FlagEnd == false; i ^= 1) {
+    pthread_mutex_lock( &Reader->Lock);
+    while (Reader->Full[i]) {
+      pthread_cond_wait( &Reader->Changed, &Reader->Lock);
+    }
+    pthread_mutex_unlock( &Reader->Lock);
+    bit32 Want = STREAM_CHUNK, Count = 0;
+    if (Reader->Limit && (Reader->Limit - Reader->Total < Want)) {
+      Want = Reader->Limit - Reader->Total;
+    }
+    while ((Count < Want) && (FlagEof == false) && (Failed == false)) {
+      ssize_t Length = read( Reader->FileNumber, Reader->Buffer[i] + Count, Want - Count);
+      if (Length > 0) {
+        Count += Length;
+      } else if (Length == 0) {
+        FlagEof = true;
+      } else if (errno != EINTR) {
+        Failed = true;
+    } }
+    if (Reader->Limit && (Failed == false)) {
+      memset( Reader->Buffer[i] + Count, 0, Want - Count);
+      Count = Want;
+    }
+    Reader->Crc = Sam9Crc32( Reader->Buffer[i], Count, Reader->Crc);
+    Reader->Total += Count;
+    FlagEnd = (Count < STREAM_CHUNK) || Failed;
+    pthread_mutex_lock( &Reader->Lock);
+    Reader->Error = Failed;
+    Reader->Count[i] = Count;
+    Reader->Full[i] = true;
+    pthread_cond_broadcast( &Reader->Changed);
+    pthread_mutex_unlock( &Reader->Lock);
+  }
+  if (Reader->FileNumber != fileno( stdin)) {
+    close( Reader->FileNumber);
+  }
+  return NULL;
+}
+
+// ----------------------------------------------------------------------------
+//  Open a streamed file and start reading it, so that the first piece is
+//  ready by the time the target is.
+// ----------------------------------------------------------------------------
+
+static bool StreamStart( ccptr FileName) {
+  pthread_t Thread;
+  FileReader.FileNumber = strcmp( FileName, "-") ? open( FileName, O_RDONLY) : fileno( stdin);
+  if (FileReader.FileNumber < 0) {
+    fprintf( stderr, "*** Failed to load file '%s' (open error)!\n", FileName);
+    return false;
+  }
+  FileReader.Limit = ParamBytes ? ValueBytes : 0;
+  ValueBytes = 0; // no image, the length is known once the stream ends
+  if (pthread_create( &Thread, NULL, StreamReaderThread, &FileReader)) {
+    fprintf( stderr, "*** Unable to start the reader thread for '%s'!\n", FileName);
+    return false;
+  }
+  pthread_detach( Thread);
+  FlagStream = true;
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+//  Send a streamed image (-f=- or a pipe) as the reader thread delivers it,
+//  each piece with its own upload command.  The length is only known once
+//  the stream ends, it is left in Job.Bytes for the verify.
+// ----------------------------------------------------------------------------
+
+static bool Sam9SendStream( Sam9Session *Session) {
+  double TimeStart = TimeNow();
+  bool FlagProgress = Session->FlagProgress, Success = true;
+  bit32 Count = STREAM_CHUNK;
+  Session->Job.Bytes = 0;
+  Session->FlagProgress = false; // progress is shown here, across the pieces
+  for (int i = 0; Success && (Count == STREAM_CHUNK); i ^= 1) {
+    pthread_mutex_lock( &FileReader.Lock);
+    while (FileReader.Full[i] == false) {
+      pthread_cond_wait( &FileReader.Changed, &FileReader.Lock);
+    }
+    bool Failed = FileReader.Error;
+    pthread_mutex_unlock( &FileReader.Lock);
+    Count = FileReader.Count[i];
+    if (Failed) {
+      fprintf( stderr, "\n*** %sFailed to load file '%s' (read error after %d bytes)!\n", Session->Label, Session->Job.FileName, Session->Job.Bytes + Count);
+      Success = false;
+    } else if (Count && (Sam9WriteMemory( Session, Session->Job.Address + Session->Job.Bytes, FileReader.Buffer[i], Count) == false)) {
+      fprintf( stderr, "*** %sFailed to upload file '%s' to memory at $%x (target unresponsive)!\n", Session->Label, Session->Job.FileName, Session->Job.Address + Session->Job.Bytes);
+      Success = false;
+    }
+    Session->Job.Bytes += Count;
+    pthread_mutex_lock( &FileReader.Lock);
+    FileReader.Full[i] = false;
+    pthread_cond_broadcast( &FileReader.Changed);
+    pthread_mutex_unlock( &FileReader.Lock);
+    if (Success && FlagProgress) {
+      printf( "Uploading file '%s' (%d bytes) to memory at $%x...\r", Session->Job.FileName, Session->Job.Bytes, Session->Job.Address);
+      fflush( stdout);
+  } }
+  Session->FlagProgress = FlagProgress;
+  if (Success) {
+    double Seconds = TimeNow() - TimeStart;
+    Session->Moved += Session->Job.Bytes;
+    printf( "%sUploaded file '%s' (%d bytes) to memory at $%x in %.2fs (%.0f bytes/s).    \n", Session->Label, Session->Job.FileName, Session->Job.Bytes, Session->Job.Address, Seconds, Seconds > 0 ? Session->Job.Bytes / Seconds : 0);
+  }
+  return Success;
+}
+
+// ----------------------------------------------------------------------------
+//  Verify a streamed image.  Its data is gone by now, so the target memory
+//  is checked against the CRC32 the reader kept: with the target's CRC32
+//  for --crc (if the applet can be used) or by readback.
+// ----------------------------------------------------------------------------
+
+static bool Sam9VerifyStream( Sam9Session *Session) {
+  double TimeStart = TimeNow();
+  bit32 Address = Session->Job.Address, Bytes = Session->Job.Bytes, Crc;
+  ccptr Method = " by CRC32";
+  bool Success = Session->Job.FlagCrc && Sam9Checksums( Session, Address, Bytes, Bytes, &Crc);
+  if (Session->Job.FlagCrc && (Success == false)) {
+    printf( "%sTarget CRC32 unavailable, verifying by readback.\n", Session->Label);
+  }
+  if (Success == false) {
+    bptr Memory = (bptr) calloc( Bytes, 1);
+    if (Memory == NULL) {
+      fprintf( stderr, "*** %sFailed to download memory from $%x (%d bytes, calloc error)!\n", Session->Label, Address, Bytes);
+      return false;
+    }
+    if ((Success = Sam9ReadMemory( Session, Address, Memory, Bytes))) {
+      double Seconds = TimeNow() - TimeStart;
+      Session->Moved += Bytes;
+      printf( "%sDownloaded memory from $%x (%d bytes) in %.2fs (%.0f bytes/s).    \n", Session->Label, Address, Bytes, Seconds, Seconds > 0 ? Bytes / Seconds : 0);
+      Crc = Sam9Crc32( Memory, Bytes);
+      Method = "";
+    }
+    free( Memory);
+  }
+  if (Success && (Crc != FileReader.Crc)) {
+    fprintf( stderr, "*** %sVerify memory at $%x (%d bytes) error, CRC32 $%8.8x expected, $%8.8x found!\n", Session->Label, Address, Bytes, FileReader.Crc, Crc);
+    return false;
+  }
+  if (Success) {
+    printf( "%sVerified memory at $%x (%d bytes)%s in %.2fs.\n", Session->Label, Address, Bytes, Method, TimeNow() - TimeStart);
+  }
+  return Success;
+}
+
+// ----------------------------------------------------------------------------
+//  Receive target memory into the -r file a piece at a time.  Each piece
+//  is read with its own download command into one of a few buffers, and a
+//  writer thread puts it in the file while the next is read, so memory use
+//  does not grow with -n.  Until the file is complete, a sidecar index
+//  (the file name plus RECEIVE_INDEX) lists the ranges that are in it:
+//
+//      sam9boot -r $20000000 33554432
+//      0 30146560
+//
+//  (the address and the bytes asked for, then the offset and length of
+//  each range received).  Only the one range from the start of the file
+//  is ever written, the index is removed once the file is complete.
+// ----------------------------------------------------------------------------
+
+struct Sam9Writer {
+  int    FileNumber;
+  int    IndexNumber;
+  bit32  Address;                     // -a, for the index
+  bit32  Bytes;                       // -n, for the index
+  bit32  Written;                     // bytes in the file, from its start
+  bool   Error;                       // write failed, the writer has stopped (under Lock)
+  byte   Buffer[RECEIVE_BUFFERS][RECEIVE_CHUNK];
+  bit32  Count[RECEIVE_BUFFERS];      // zero ends the file
+  bool   Full[RECEIVE_BUFFERS];       // to be written, or free to fill
+  pthread_mutex_t Lock;
+  pthread_cond_t  Changed;
+};
+
+static bool WriteIndex( Sam9Writer *Writer) {
+  char Text[80];
+  int Length = snprintf( Text, sizeof( Text), "sam9boot -r $%x %d\n0 %d\n", Writer->Address, Writer->Bytes, Writer->Written);
+  return (pwrite( Writer->IndexNumber, Text, Length, 0) == Length) && (ftruncate( Writer->IndexNumber, Length) == 0);
+}
+
+static void *ReceiveWriterThread( void *Argument) {
+  Sam9Writer *Writer = (Sam9Writer *) Argument;
+  bool Failed = false;
+  for (int i = 0; ; i = (i + 1) % RECEIVE_BUFFERS) {
+    pthread_mutex_lock( &Writer->Lock);
+    while (Writer->Full[i] == false) {
+      pthread_cond_wait( &Writer->Changed, &Writer->Lock);
+    }
+    pthread_mutex_unlock( &Writer->Lock);
+    bit32 Count = Writer->Count[i];
+    if (Count == 0) {
+      break;
+    }
+    if ((Failed == false) && (pwrite( Writer->FileNumber, Writer->Buffer[i], Count, Writer->Written) == (ssize_t) Count)) {
+      Writer->Written += Count;
+      Failed = (WriteIndex( Writer) == false);
+    } else {
+      Failed = true;
+    }
+    pthread_mutex_lock( &Writer->Lock);
+    Writer->Error = Failed;
+    Writer->Full[i] = false;
+    pthread_cond_broadcast( &Writer->Changed);
+    pthread_mutex_unlock( &Writer->Lock);
+  }
+  return NULL;
+}
+
+// ----------------------------------------------------------------------------
+//  Check that target memory still holds what a --resume journal says was
+//  done, by the last piece done: by the target's CRC32 where the applet
+//  area is clear of the whole region (Start, Bytes), as loading the applet
+//  would overwrite the pieces before, otherwise by reading back its last
+//  RESUME_CHECK bytes.
+// ----------------------------------------------------------------------------
+
+static bool SpotCheck( Sam9Session *Session, bit32 Start, bit32 Bytes, bit32 Address, const byte *Data, bit32 Count) {
+  bit32 Applet = Session->Options.Applet, Crc;
+  bool FlagProgress = Session->FlagProgress, Same = false;
+  Session->FlagProgress = false;
+  if (((Start + Bytes <= Applet) || (Applet + APPLET_AREA <= Start)) && Sam9Checksums( Session, Address, Count, Count, &Crc)) {
+    Same = (Crc == Sam9Crc32( Data, Count));
+  } else {
+    bit32 Length = (Count < RESUME_CHECK) ? Count : RESUME_CHECK;
+    if (bptr Memory = (bptr) malloc( Length)) {
+      Same = Sam9ReadMemory( Session, Address + Count - Length, Memory, Length) && (memcmp( Memory, Data + Count - Length, Length) == 0);
+      free( Memory);
+  } }
+  Session->FlagProgress = FlagProgress;
+  return Same;
+}
+
+// ----------------------------------------------------------------------------
+//  Find where a -r --resume can carry on: the end of the range in the
+//  index, if it is for the same address and size, the file holds it and
+//  the last piece of it still matches target memory.  Zero to start over.
+// ----------------------------------------------------------------------------
+
+static bit32 ReceiveResumePoint( Sam9Session *Session, ccptr FileName, ccptr IndexName) {
+  bit32 Address, Bytes, Start, Done = 0;
+  struct stat Status;
+  if (fptr f = fopen( IndexName, "r")) {
+    if ((fscanf( f, "sam9boot -r $%x %u %u %u", &Address, &Bytes, &Start, &Done) != 4) || (Address != Session->Job.Address)
+     || (Bytes != Session->Job.Bytes) || (Start != 0) || (Done > Bytes) || (stat( FileName, &Status) < 0) || (Status.st_size < Done)) {
+      Done = 0;
+    }
+    fclose( f);
+  }
+  if (Done) {
+    bit32 Count = (Done < RECEIVE_CHUNK) ? Done : RECEIVE_CHUNK;
+    bptr Data = (bptr) malloc( Count);
+    int File = open( FileName, O_RDONLY);
+    if ((Data == NULL) || (File < 0) || (pread( File, Data, Count, Done - Count) != (ssize_t) Count) || (SpotCheck( Session, Session->Job.Address, Session->Job.Bytes, Session->Job.Address + Done - Count, Data, Count) == false)) {
+      printf( "%sFile '%s' does not match memory at $%x, receiving it all again.\n", Session->Label, FileName, Session->Job.Address + Done - Count);
+      Done = 0;
+    }
+    if (File >= 0) {
+      close( File);
+    }
+    free( Data);
+  }
+  return Done;
+}
+
+static bool Sam9ReceiveFile( Sam9Session *Session) {
+  char IndexName[PATH_MAX];
+  ccptr FileName = Session->Job.FileName;
+  snprintf( IndexName, sizeof( IndexName), "%s" RECEIVE_INDEX, FileName);
+  Sam9Writer *Writer = (Sam9Writer *) calloc( 1, sizeof( Sam9Writer));
+  if (Writer == NULL) {
+    fprintf( stderr, "*** %sFailed to download memory from $%x (%d bytes, calloc error)!\n", Session->Label, Session->Job.Address, Session->Job.Bytes);
+    return false;
+  }
+  Writer->Address = Session->Job.Address;
+  Writer->Bytes = Session->Job.Bytes;
+  bit32 Resumed = Session->Job.FlagResume ? ReceiveResumePoint( Session, FileName, IndexName) : 0;
+  if (Resumed) {
+    printf( "%sResuming download to file '%s' at offset %d.\n", Session->Label, FileName, Resumed);
+  }
+  Writer->Written = Resumed;
+  Writer->FileNumber = open( FileName, O_WRONLY | O_CREAT | (Resumed ? 0 : O_TRUNC), 0666);
+  Writer->IndexNumber = open( IndexName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  pthread_mutex_init( &Writer->Lock, NULL);
+  pthread_cond_init( &Writer->Changed, NULL);
+  pthread_t Thread;
+  bool Success = false;
+  if ((Writer->FileNumber < 0) || (Writer->IndexNumber < 0) || (WriteIndex( Writer) == false)) {
+    fprintf( stderr, "*** Unable to open file '%s' for write!\n", (Writer->FileNumber < 0) ? FileName : IndexName);
+  } else if (pthread_create( &Thread, NULL, ReceiveWriterThread, Writer)) {
+    fprintf( stderr, "*** Unable to start the writer thread for '%s'!\n", FileName);
+  } else {
+    double TimeStart = TimeNow();
+    bool FlagProgress = Session->FlagProgress;
+    bit32 Offset = Resumed;
+    int i = 0;
+    Session->FlagProgress = false; // progress is shown here, across the pieces
+    for (Success = true; Success; i = (i + 1) % RECEIVE_BUFFERS) {
+      pthread_mutex_lock( &Writer->Lock);
+      while (Writer->Full[i]) {
+        pthread_cond_wait( &Writer->Changed, &Writer->Lock);
+      }
+      bool Failed = Writer->Error;
+      pthread_mutex_unlock( &Writer->Lock);
+      bit32 Count = (Writer->Bytes - Offset < RECEIVE_CHUNK) ? Writer->Bytes - Offset : RECEIVE_CHUNK;
+      if (Failed || (Count == 0)) {
+        break;
+      }
+      if (Sam9ReadMemory( Session, Writer->Address + Offset, Writer->Buffer[i], Count) == false) {
+        Success = false; // keep i, the writer is waiting on this buffer
+        break;
+      }
+      Offset += Count;
+      pthread_mutex_lock( &Writer->Lock);
+      Writer->Count[i] = Count;
+      Writer->Full[i] = true;
+      pthread_cond_broadcast( &Writer->Changed);
+      pthread_mutex_unlock( &Writer->Lock);
+      if (FlagProgress) {
+        printf( "Downloading memory from $%x (%d bytes)...\r", Writer->Address, Offset);
+        fflush( stdout);
+    } }
+    Session->FlagProgress = FlagProgress;
+    pthread_mutex_lock( &Writer->Lock); // the buffer is free, end the file
+    Writer->Count[i] = 0;
+    Writer->Full[i] = true;
+    pthread_cond_broadcast( &Writer->Changed);
+    pthread_mutex_unlock( &Writer->Lock);
+    pthread_join( Thread, NULL);
+    if (Success) {
+      double Seconds = TimeNow() - TimeStart;
+      Session->Moved += Offset - Resumed;
+      printf( "%sDownloaded memory from $%x (%d bytes) in %.2fs (%.0f bytes/s).    \n", Session->Label, Writer->Address + Resumed, Offset - Resumed, Seconds, Seconds > 0 ? (Offset - Resumed) / Seconds : 0);
+    }
+    if (Writer->Error) {
+      fprintf( stderr, "*** Error writing %d bytes to file '%s'!\n", Writer->Bytes, FileName);
+      Success = false;
+  } }
+  if (Writer->FileNumber >= 0) {
+    close( Writer->FileNumber);
+  }
+  if (Writer->IndexNumber >= 0) {
+    close( Writer->IndexNumber);
+  }
+  if (Success) {
+    unlink( IndexName);
+    printf( "Wrote %d bytes to file '%s'.\n", Writer->Written, FileName);
+  } else if (Writer->Written) {
+    fprintf( stderr, "*** Kept %d of %d bytes in file '%s', the ranges received are in '%s'!\n", Writer->Written, Writer->Bytes, FileName, IndexName);
+  }
+  pthread_mutex_destroy( &Writer->Lock);
+  pthread_cond_destroy( &Writer->Changed);
+  free( Writer);
+  return Success;
+}
+
+// ----------------------------------------------------------------------------
+//  Write a region of the file image RESUME_CHUNK bytes at a time for
+//  --resume, noting the bytes done in a journal after each piece:
+//
+//      sam9boot --resume /dev/ttyUSB0 $1c291ca3 $20000000 33554432
+//      30146560
+//
+//  (the port, the CRC32 of the region, its address and size, then the
+//  bytes done).  The journal is named for all but the size so that each
+//  port, image and address has its own, and is removed once the region is
+//  done.  If one is found the region carries on after the bytes done, if
+//  the last piece of them still matches target memory.
+// ----------------------------------------------------------------------------
+
+static bool Sam9WriteResumable( Sam9Session *Session, bit32 Address, const byte *Image, bit32 Bytes, bit32 &Sent) {
+  char Name[PATH_MAX], Header[PATH_MAX + 64], Text[PATH_MAX + 64];
+  ccptr Port = strrchr( Session->Port, '/') ? strrchr( Session->Port, '/') + 1 : Session->Port;
+  bit32 Crc = Sam9Crc32( Image, Bytes), Done = 0;
+  snprintf( Name, sizeof( Name), RESUME_JOURNAL "-%s-%8.8x-%x", Port, Crc, Address);
+  snprintf( Header, sizeof( Header), "sam9boot --resume %s $%8.8x $%x %d\n", Session->Port, Crc, Address, Bytes);
+  if (fptr f = fopen( Name, "r")) {
+    if (fgets( Text, sizeof( Text), f) && (strcmp( Text, Header) == 0) && fgets( Text, sizeof( Text), f)) {
+      Done = strtoul( Text, NULL, 10);
+    }
+    fclose( f);
+  }
+  if ((Done > Bytes) || ((Done % RESUME_CHUNK) && (Done != Bytes))) {
+    Done = 0;
+  }
+  if (Done) {
+    bit32 Count = Done - (Done - 1) / RESUME_CHUNK * RESUME_CHUNK;
+    if (SpotCheck( Session, Address, Bytes, Address + Done - Count, Image + Done - Count, Count)) {
+      printf( "%sResuming upload to memory at $%x at offset %d.\n", Session->Label, Address, Done);
+    } else {
+      printf( "%sMemory at $%x does not match journal '%s', sending it all again.\n", Session->Label, Address + Done - Count, Name);
+      Done = 0;
+  } }
+  bool FlagProgress = Session->FlagProgress, Success = true;
+  Sent = Bytes - Done;
+  Session->FlagProgress = false; // progress is shown here, across the pieces
+  while (Success && (Done < Bytes)) {
+    bit32 Count = (Bytes - Done < RESUME_CHUNK) ? Bytes - Done : RESUME_CHUNK;
+    if ((Success = Sam9WriteMemory( Session, Address + Done, Image + Done, Count))) {
+      Done += Count;
+      fptr f = fopen( Name, "w");
+      if (f) {
+        fprintf( f, "%s%d\n", Header, Done);
+        Success = (fclose( f) == 0);
+      }
+      if ((f == NULL) || (Success == false)) {
+        fprintf( stderr, "*** %sUnable to write journal '%s'!\n", Session->Label, Name);
+        Success = false;
+      }
+      if (FlagProgress) {
+        printf( "Uploading file '%s' (%d bytes) to memory at $%x...\r", Session->Job.FileName, Done, Address);
+        fflush( stdout);
+  } } }
+  Session->FlagProgress = FlagProgress;
+  if (Success) {
+    unlink( Name);
+  }
+  return Success;
+}
+
+// ----------------------------------------------------------------------------
+//  Send one region of the file image with the method the parameters ask
+//  for (--delta, --sparse, --compress, --resume or plain).
+// ----------------------------------------------------------------------------
+
+static bool Sam9SendRegion( Sam9Session *Session, bit32 Address, const byte *Image, bit32 Bytes) {
+  double TimeStart = TimeNow();
+  bit32 Sent = Bytes;
+  bit32 Stage = Session->Job.Stage ? Session->Job.Stage : (Address + Bytes + 1023) & ~1023;
+  bool Uploaded = Session->Job.FlagDelta    ? Sam9WriteDelta( Session, Address, Image, Bytes, Sent)
+                : Session->Job.FlagSparse   ? Sam9WriteSparse( Session, Address, Image, Bytes, Sent)
+                : Session->Job.FlagCompress ? Sam9WriteCompressed( Session, Address, Stage, Image, Bytes, Sent)
+                : Session->Job.FlagResume   ? Sam9WriteResumable( Session, Address, Image, Bytes, Sent)
+                                            : Sam9WriteMemory( Session, Address, Image, Bytes);
+  if (Uploaded == false) {
+    fprintf( stderr, "*** %sFailed to upload file '%s' to memory at $%x (target unresponsive)!\n", Session->Label, Session->Job.FileName, Address);
+    return false;
+  }
+  double Seconds = TimeNow() - TimeStart;
+  Session->Moved += Sent;
+  printf( "%sUploaded file '%s' (%d bytes) to memory at $%x in %.2fs (%.0f bytes/s).    \n", Session->Label, Session->Job.FileName, Bytes, Address, Seconds, Seconds > 0 ? Bytes / Seconds : 0);
+  if (Session->Job.FlagDelta && (FlagQuiet == false)) {
+    printf( "%sSent %d of %d bytes, %d unchanged.\n", Session->Label, Sent, Bytes, Bytes - Sent);
+  }
+  if (Session->Job.FlagSparse && (FlagQuiet == false)) {
+    printf( "%sSent %d of %d bytes, %d of 0x00/0xff filled on the target.\n", Session->Label, Sent, Bytes, Bytes - Sent);
+  }
+  if (Session->Job.FlagResume && (Sent < Bytes) && (FlagQuiet == false)) {
+    printf( "%sSent %d of %d bytes, %d were already done.\n", Session->Label, Sent, Bytes, Bytes - Sent);
+  }
+  if (Session->Job.FlagCompress && (FlagQuiet == false)) {
+    printf( "%sSent %d bytes compressed for %d (%.1f:1), expanded and checked on the target.\n", Session->Label, Sent, Bytes, Sent ? (double) Bytes / Sent : 0);
+  }
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+//  Verify one region of target memory against the file image, with the
+//  target's CRC32 for --crc (if the applet can be used) or by readback.
+// ----------------------------------------------------------------------------
+
+static bool Sam9VerifyRegion( Sam9Session *Session, bit32 Address, const byte *Image, bit32 Bytes) {
+  double TimeStart = TimeNow();
+  bit32 Offset;
+  if (Session->Job.FlagCrc) {
+    if (Sam9VerifyCrc( Session, Address, Image, Bytes, Offset)) {
+      if (Offset < Bytes) {
+        fprintf( stderr, "*** %sVerify memory at $%x (%d bytes) error at offset %d!\n", Session->Label, Address, Bytes, Offset);
+        return false;
+      }
+      printf( "%sVerified memory at $%x (%d bytes) by CRC32 in %.2fs.\n", Session->Label, Address, Bytes, TimeNow() - TimeStart);
+      return true;
+    }
+    printf( "%sTarget CRC32 unavailable, verifying by readback.\n", Session->Label);
+  }
+  bptr Memory = (bptr) calloc( Bytes, 1);
+  if (Memory == NULL) {
+    fprintf( stderr, "*** %sFailed to download memory from $%x (%d bytes, calloc error)!\n", Session->Label, Address, Bytes);
+    return false;
+  }
+  bool Success = Sam9ReadMemory( Session, Address, Memory, Bytes);
+  if (Success) {
+    double Seconds = TimeNow() - TimeStart;
+    Session->Moved += Bytes;
+    printf( "%sDownloaded memory from $%x (%d bytes) in %.2fs (%.0f bytes/s).    \n", Session->Label, Address, Bytes, Seconds, Seconds > 0 ? Bytes / Seconds : 0);
+    for (Offset = 0; (Offset < Bytes) && (Image[Offset] == Memory[Offset]); Offset++) {
+    }
+    if (Offset < Bytes) {
+      fprintf( stderr, "*** %sVerify memory at $%x (%d bytes) error at offset %d!\n", Session->Label, Address, Bytes, Offset);
+      Success = false;
+    } else {
+      printf( "%sVerified memory at $%x (%d bytes).\n", Session->Label, Address, Bytes);
+  } }
+  free( Memory);
+  return Success;
+}
+
+// ----------------------------------------------------------------------------
+//  Run everything the parameters ask for against the target on one port.
+//  The file image is already loaded and is shared read-only between all
+//  sessions, everything else the session touches is its own.
+// ----------------------------------------------------------------------------
+
+static bool Sam9RunSession( Sam9Session *Session) {
+  bool Chatty = Session->FlagProgress && (FlagQuiet == false);
+  bool Success = true;
+  double TimeOpen = TimeNow();
+  if (Sam9Open( Session, Chatty) == false) {
+    return false;
+  }
+
+  //-------
+  //  cpu
+  //-------
+
+  if (FlagCpu) {
+    bit32 PartId;
+    if (Sam9Read( Session, 0xfffff240, 4, PartId, Session->FlagProgress)) {
+      printf( "%sPartId = $%8.8X\n", Session->Label, PartId);
+    } else {
+      fflush( stdout);
+      fprintf( stderr, "\n*** %sFailed to get cpu type (target unresponsive)!", Session->Label);
+      fflush( stderr);
+      Success = false;
+  } }
+  GetResponse( Session, Session->FlagProgress, FRAME_DRAIN, RESPONSE_IDLE_MS);
+  if (Session->FlagProgress) {
+    printf( "\n");
+  }
+
+  //--------
+  //  send
+  //--------
+
+  Sam9Segment Whole = { Session->Job.Address, Session->Job.Image, Session->Job.Bytes, 0 };
+  const Sam9Segment *Segments = Session->Job.Segments ? Session->Job.Segments : &Whole;
+  int SegmentCount = Session->Job.Segments ? Session->Job.SegmentCount : 1;
+  for (int i = 0; Success && Session->Job.FlagSend && (i < SegmentCount); i++) { // before the data, which may cover the applet area
+    if (Segments[i].Zero) {
+      bit32 Address = Segments[i].Address + Segments[i].Bytes, Sent;
+      if (Sam9FillMemory( Session, Address, Segments[i].Zero, 0, Sent)) {
+        Session->Moved += Sent;
+        if (FlagQuiet == false) {
+          printf( "%sZero-filled memory at $%x (%d bytes, %d sent).\n", Session->Label, Address, Segments[i].Zero, Sent);
+        }
+      } else {
+        fprintf( stderr, "*** %sFailed to zero-fill memory at $%x (target unresponsive)!\n", Session->Label, Address);
+        Success = false;
+  } } }
+  for (int i = 0; Success && Session->Job.FlagSend && (i < SegmentCount); i++) {
+    if (Segments[i].Bytes) {
+      Success = Sam9SendRegion( Session, Segments[i].Address, Segments[i].Data, Segments[i].Bytes);
+  } }
+  if (Success && Session->Job.FlagSend && FlagStream) {
+    Success = Sam9SendStream( Session);
+  }
+
+  //----------
+  //  verify
+  //----------
+
+  for (int i = 0; Success && Session->Job.FlagVerify && (i < SegmentCount); i++) {
+    if (Segments[i].Bytes) {
+      Success = Sam9VerifyRegion( Session, Segments[i].Address, Segments[i].Data, Segments[i].Bytes);
+    }
+    if (Success && Segments[i].Zero) {
+      if (bptr Zero = (bptr) calloc( Segments[i].Zero, 1)) {
+        Success = Sam9VerifyRegion( Session, Segments[i].Address + Segments[i].Bytes, Zero, Segments[i].Zero);
+        free( Zero);
       } else {
-        fprintf( stderr, "*** Unable to open device '%s' for i/o!\n", ParamPort);
+        fprintf( stderr, "*** %sFailed to verify memory at $%x (%d bytes, calloc error)!\n", Session->Label, Segments[i].Address + Segments[i].Bytes, Segments[i].Zero);
+        Success = false;
+  } } }
+  if (Success && Session->Job.FlagVerify && FlagStream) {
+    Success = Sam9VerifyStream( Session);
+  }
+
+  //--------
+  //  recv
+  //--------
+
+  if (Success && (FlagReceive | FlagDump) && (Session->Job.Bytes == 0)) {
+    printf( "*** Parameters '-r' and '-d' require '-n'!\n");
+    Success = false;
+  }
+  if (Success && FlagReceive) {
+    Success = Sam9ReceiveFile( Session);
+  }
+
+  //--------------------------------------------------
+  //  dump - load image buffer, or the file just made
+  //--------------------------------------------------
+
+  if (Success && FlagDump && FlagReceive) {
+    bptr Image;
+    bit32 Count;
+    if (LoadImage( Session->Job.FileName, 0, Image, Count)) {
+      printf( "\n");
+      DumpMemory( stdout, Session->Job.Address, Image, Count);
+      UnloadImage( Image, Count);
+    } else {
+      Success = false;
+  } }
+  if (Success && FlagDump && (FlagReceive == false)) {
+    double TimeStart = TimeNow();
+    if (LoadMemory( Session, Session->Job.Address, Session->Job.Bytes)) {
+      double Seconds = TimeNow() - TimeStart;
+      Session->Moved += Session->Job.Bytes;
+      printf( "%sDownloaded memory from $%x (%d bytes) in %.2fs (%.0f bytes/s).    \n", Session->Label, Session->Job.Address, Session->Job.Bytes, Seconds, Seconds > 0 ? Session->Job.Bytes / Seconds : 0);
+    } else {
+      Success = false;
+  } }
+
+  //-----------------------------
+  //  dump data in image buffer
+  //-----------------------------
+
+  if (FlagDump && Session->MemoryCount) {
+    printf( "\n");
+    DumpMemory( stdout, Session->Job.Address, Session->MemoryBuffer, Session->MemoryCount);
+  }
+
+  //---------------------------------------------
+  //  interactive terminal mode w/optional 'go'
+  //---------------------------------------------
+
+  Sam9TurboOff( Session);
+
+  if (FlagInteractive) {
+    if (Session->FlagBinary) {
+      Sam9SetBinaryMode( Session, false, FlagTrace);
+    }
+    TerminalEmulator( Session);
+  } else {
+    if (Success && Session->Job.FlagJump) {
+      fprintf( Session->FileHandle, "G%X#\n", Session->Job.AddrJump);
+      printf( "%sG%X#\n", Session->Label, Session->Job.AddrJump);
+      GetResponse( Session, Session->FlagProgress, FRAME_DRAIN, RESPONSE_IDLE_MS);
+    } else if (Session->FlagBinary) {
+      Sam9SetBinaryMode( Session, false, FlagTrace);
+  } }
+  fclose( Session->FileHandle);
+  free( Session->MemoryBuffer);
+  Session->MemoryBuffer = NULL;
+  Session->Seconds = TimeNow() - TimeOpen;
+  return Success;
+}
+
+// ----------------------------------------------------------------------------
+//  Thread body for one port when several are flashed at once.
+// ----------------------------------------------------------------------------
+
+static void *Sam9SessionThread( void *Argument) {
+  Sam9Session *Session = (Sam9Session *) Argument;
+  Session->Success = Sam9RunSession( Session);
+  return NULL;
+}
+
+// ----------------------------------------------------------------------------
+//  Show the per-port results and the aggregate throughput of a multi-port
+//  run.  Returns true if all passed.
+// ----------------------------------------------------------------------------
+
+static bool Sam9Report( Sam9Session *Sessions, int Count, double Seconds) {
+  int Passed = 0;
+  double Bytes = 0;
+  printf( "\n%-24s %-6s %10s %8s %10s\n", "Port", "Result", "Bytes", "Seconds", "Bytes/s");
+  for (int i = 0; i < Count; i++) {
+    Sam9Session *Session = &Sessions[i];
+    printf( "%-24s %-6s %10d %8.2f %10.0f\n", Session->Port, Session->Success ? "pass" : "FAIL", Session->Moved, Session->Seconds, Session->Seconds > 0 ? Session->Moved / Session->Seconds : 0);
+    Passed += Session->Success ? 1 : 0;
+    Bytes += Session->Moved;
+  }
+  printf( "\n%d of %d ports passed, %.0f bytes in %.2fs (%.0f bytes/s aggregate).\n\n", Passed, Count, Bytes, Seconds, Seconds > 0 ? Bytes / Seconds : 0);
+  return Passed == Count;
+}
+
+// ----------------------------------------------------------------------------
+//  Run one session per port, each in its own thread, then report per-port
+//  results and the aggregate throughput.  Returns true if all passed.
+// ----------------------------------------------------------------------------
+
+static bool Sam9RunSessions( Sam9Session *Sessions, int Count) {
+  pthread_t Threads[PORTS_MAX];
+  double TimeStart = TimeNow();
+  for (int i = 0; i < Count; i++) {
+    if (pthread_create( &Threads[i], NULL, Sam9SessionThread, &Sessions[i])) {
+      fprintf( stderr, "*** Unable to start thread for '%s'!\n", Sessions[i].Port);
+      Threads[i] = 0;
+  } }
+  for (int i = 0; i < Count; i++) {
+    if (Threads[i]) {
+      pthread_join( Threads[i], NULL);
+  } }
+  return Sam9Report( Sessions, Count, TimeNow() - TimeStart);
+}
+
+// ----------------------------------------------------------------------------
+//  Run the job twice on every port, once with each serial transport, and
+//  compare the system calls each needed per KB moved over the link.
+// ----------------------------------------------------------------------------
+
+static bool Sam9Bench( Sam9Session *Sessions, int Count) {
+  static const ccptr Transports[2] = { "write/poll/read", "io_uring" };
+  double Bytes[2] = {}, Calls[2] = {}, Seconds[2] = {};
+  bool Success = true;
+  for (int Pass = 0; Pass < 2; Pass++) {
+    printf( "Transport %s:\n\n", Transports[Pass]);
+    for (int i = 0; i < Count; i++) {
+      Sessions[i].Options.Uring = (Pass == 1);
+      Sessions[i].Moved = 0;
+      Sessions[i].Syscalls = 0;
+    }
+    double TimeStart = TimeNow();
+    if (Count > 1) {
+      Success &= Sam9RunSessions( Sessions, Count);
+    } else {
+      Success &= Sessions->Success = Sam9RunSession( Sessions);
+      printf( "\n");
+    }
+    Seconds[Pass] = TimeNow() - TimeStart;
+    for (int i = 0; i < Count; i++) {
+      Bytes[Pass] += Sessions[i].Moved;
+      Calls[Pass] += Sessions[i].Syscalls;
+  } }
+  printf( "%-16s %10s %8s %10s %12s\n", "Transport", "Bytes", "Seconds", "Syscalls", "Syscalls/KB");
+  for (int Pass = 0; Pass < 2; Pass++) {
+    printf( "%-16s %10.0f %8.2f %10.0f %12.1f\n", Transports[Pass], Bytes[Pass], Seconds[Pass], Calls[Pass], Bytes[Pass] > 0 ? Calls[Pass] * 1024 / Bytes[Pass] : 0);
+  }
+  printf( "\n");
+  return Success;
+}
+
+// ----------------------------------------------------------------------------
+//  The --async equivalent of Sam9RunSession(), one coroutine per port.  It
+//  does the cpu query, send, verify and jump, everything that needs no
+//  console.
+// ----------------------------------------------------------------------------
+
+static Sam9Task<bool> Sam9AsyncJob( Sam9AsyncSession *Async) {
+  Sam9Session *Session = Async->Session;
+  double TimeOpen = TimeNow();
+  bool Success = co_await Async->Open();
+
+  if (Success && FlagCpu) {
+    bit32 PartId;
+    bool Received = co_await Async->PartId( PartId);
+    if (Received) {
+      printf( "%sPartId = $%8.8X\n", Session->Label, PartId);
+    } else {
+      fprintf( stderr, "*** %sFailed to get cpu type (target unresponsive)!\n", Session->Label);
+      Success = false;
+  } }
+
+  if (Success && Session->Job.FlagSend) {
+    double TimeStart = TimeNow();
+    bool Sent = co_await Async->Write( Session->Job.Address, std::span<const byte>( Session->Job.Image, Session->Job.Bytes));
+    if (Sent) {
+      double Seconds = TimeNow() - TimeStart;
+      Session->Moved += Session->Job.Bytes;
+      printf( "%sUploaded file '%s' (%d bytes) to memory at $%x in %.2fs (%.0f bytes/s).\n", Session->Label, Session->Job.FileName, Session->Job.Bytes, Session->Job.Address, Seconds, Seconds > 0 ? Session->Job.Bytes / Seconds : 0);
+    } else {
+      fprintf( stderr, "*** %sFailed to upload file '%s' to memory at $%x (target unresponsive)!\n", Session->Label, Session->Job.FileName, Session->Job.Address);
+      Success = false;
+  } }
+
+  if (Success && Session->Job.FlagVerify) {
+    if ((Session->MemoryBuffer = (bptr) calloc( Session->Job.Bytes, 1)) == NULL) {
+      fprintf( stderr, "*** %sFailed to download memory from $%x (%d bytes, calloc error)!\n", Session->Label, Session->Job.Address, Session->Job.Bytes);
+      Success = false;
+    } else {
+      Success = co_await Async->Read( Session->Job.Address, std::span<byte>( Session->MemoryBuffer, Session->Job.Bytes));
+    }
+    if (Success) {
+      Session->Moved += Session->Job.Bytes;
+      if (memcmp( Session->Job.Image, Session->MemoryBuffer, Session->Job.Bytes)) {
+        fprintf( stderr, "*** %sVerify memory at $%x (%d bytes) failed!\n", Session->Label, Session->Job.Address, Session->Job.Bytes);
+        Success = false;
+      } else {
+        printf( "%sVerified memory at $%x (%d bytes).\n", Session->Label, Session->Job.Address, Session->Job.Bytes);
+    } }
+    free( Session->MemoryBuffer);
+    Session->MemoryBuffer = NULL;
+  }
+
+  if (Success && Session->Job.FlagJump) {
+    printf( "%sG%X#\n", Session->Label, Session->Job.AddrJump);
+    co_await Async->Go( Session->Job.AddrJump);
+  }
+  co_await Async->Close();
+  Session->Seconds = TimeNow() - TimeOpen;
+  Session->Success = Success;
+  co_return Success;
+}
+
+// ----------------------------------------------------------------------------
+//  Run one coroutine session per port, all from this thread, then report
+//  as Sam9RunSessions() does.
+// ----------------------------------------------------------------------------
+
+static bool Sam9RunAsync( Sam9Session *Sessions, int Count) {
+  Sam9Loop Loop;
+  if (Loop.Epoll < 0) {
+    fprintf( stderr, "*** Unable to create the event loop!\n");
+    return false;
+  }
+  std::vector<Sam9AsyncSession> Async( Count);
+  double TimeStart = TimeNow();
+  for (int i = 0; i < Count; i++) {
+    Async[i].Session = &Sessions[i];
+    Async[i].Loop = &Loop;
+    Loop.Spawn( Sam9AsyncJob( &Async[i]));
+  }
+  Loop.Run();
+  return Sam9Report( Sessions, Count, TimeNow() - TimeStart);
+}
+
+// ----------------------------------------------------------------------------
+//  Local socket plumbing shared by the daemon and the session server.  A
+//  request is a number of lines ended by an empty line, the reply is plain
+//  text read until the server closes the connection.
+// ----------------------------------------------------------------------------
+
+#define SOCKET_REQUEST    4096 // longest request or reply
+#define SOCKET_REQUEST_MS 5000 // time allowed to send a request
+
+static bool SocketAddress( struct sockaddr_un &Address, ccptr SocketName) {
+  memset( &Address, 0, sizeof( Address));
+  Address.sun_family = AF_UNIX;
+  if (strlen( SocketName) >= sizeof( Address.sun_path)) {
+    fprintf( stderr, "*** Socket name '%s' too long!\n", SocketName);
+    return false;
+  }
+  strcpy( Address.sun_path, SocketName);
+  return true;
+}
+
+static int SocketListen( ccptr SocketName) {
+  struct sockaddr_un Address;
+  if (SocketAddress( Address, SocketName) == false) {
+    return -1;
+  }
+  int Listener = socket( AF_UNIX, SOCK_STREAM, 0);
+  unlink( SocketName);
+  if ((Listener < 0) || bind( Listener, (struct sockaddr *) &Address, sizeof( Address)) || listen( Listener, 16)) {
+    fprintf( stderr, "*** Unable to listen on socket '%s' (%s)!\n", SocketName, strerror( errno));
+    return -1;
+  }
+  return Listener;
+}
+
+static int SocketConnect( ccptr SocketName) {
+  struct sockaddr_un Address;
+  if (SocketAddress( Address, SocketName) == false) {
+    return -1;
+  }
+  int Server = socket( AF_UNIX, SOCK_STREAM, 0);
+  if ((Server < 0) || connect( Server, (struct sockaddr *) &Address, sizeof( Address))) {
+    fprintf( stderr, "*** Unable to connect to socket '%s' (%s)!\n", SocketName, strerror( errno));
+    return -1;
+  }
+  return Server;
+}
+
+static bool SocketReadRequest( int Client, char Text[SOCKET_REQUEST]) {
+  int Length = 0;
+  double Deadline = TimeNow() + SOCKET_REQUEST_MS / 1000.0;
+  while ((Length < 2) || strncmp( Text + Length - 2, "\n\n", 2)) {
+    struct pollfd pfd = { Client, POLLIN, 0 };
+    int Remaining = (int) ((Deadline - TimeNow()) * 1000);
+    int Count = 0;
+    if ((Length == SOCKET_REQUEST - 1) || (Remaining <= 0) || (poll( &pfd, 1, Remaining) <= 0)
+        || ((Count = read( Client, Text + Length, SOCKET_REQUEST - 1 - Length)) <= 0)) {
+      return false;
+    }
+    Length += Count;
+  }
+  Text[Length] = 0;
+  return true;
+}
+
+static void SocketReply( int Client, ccptr Format, ...) {
+  char Line[256];
+  va_list Arguments;
+  va_start( Arguments, Format);
+  int Length = vsnprintf( Line, sizeof( Line), Format, Arguments);
+  va_end( Arguments);
+  if (Length > (int) sizeof( Line) - 1) {
+    Length = sizeof( Line) - 1;
+  }
+  send( Client, Line, Length, MSG_NOSIGNAL);
+}
+
+// Send a request and replace it with the reply, then close the connection.
+
+static bool SocketExchange( int Server, char Text[SOCKET_REQUEST], int Length) {
+  if (FileWriteBlock( Server, Text, Length) == false) {
+    close( Server);
+    return false;
+  }
+  Length = 0;
+  int Count;
+  while ((Length < SOCKET_REQUEST - 1) && ((Count = read( Server, Text + Length, SOCKET_REQUEST - 1 - Length)) > 0)) {
+    Length += Count;
+  }
+  Text[Length] = 0;
+  close( Server);
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+//  Cache of file images for the daemon.  An image is loaded once and reused
+//  by every job naming the same file (and -n) for as long as the file's size
+//  and modification time stay the same.  Images in use by a running job are
+//  never evicted.
+// ----------------------------------------------------------------------------
+
+#define IMAGE_CACHE 16
+
+struct Sam9Image {
+  cptr   FileName;
+  bit32  Requested;                   // -n of the job, zero for whole file
+  time_t Modified;
+  off_t  Size;
+  bptr   Buffer;
+  bit32  Count;
+  int    Users;                       // jobs currently using the image
+  double LastUse;
+};
+
+static Sam9Image ImageCache[IMAGE_CACHE];
+static pthread_mutex_t ImageLock = PTHREAD_MUTEX_INITIALIZER;
+
+static Sam9Image *ImageAcquire( ccptr FileName, bit32 Requested) {
+  struct stat Status;
+  if (stat( FileName, &Status)) {
+    return NULL;
+  }
+  pthread_mutex_lock( &ImageLock);
+  Sam9Image *Image = NULL, *Victim = NULL;
+  for (int i = 0; (Image == NULL) && (i < IMAGE_CACHE); i++) {
+    Sam9Image *Entry = &ImageCache[i];
+    if (Entry->FileName && (strcmp( Entry->FileName, FileName) == 0) && (Entry->Requested == Requested)
+        && (Entry->Modified == Status.st_mtime) && (Entry->Size == Status.st_size)) {
+      Image = Entry;
+    } else if ((Entry->Users == 0) && ((Victim == NULL) || (Entry->LastUse < Victim->LastUse))) {
+      Victim = Entry;
+  } }
+  if ((Image == NULL) && Victim) {
+    free( Victim->FileName);
+    UnloadImage( Victim->Buffer, Victim->Count);
+    memset( Victim, 0, sizeof( *Victim));
+    if (LoadImage( FileName, Requested, Victim->Buffer, Victim->Count)) {
+      Victim->FileName = strdup( FileName);
+      Victim->Requested = Requested;
+      Victim->Modified = Status.st_mtime;
+      Victim->Size = Status.st_size;
+      Image = Victim;
+  } }
+  if (Image) {
+    Image->Users++;
+    Image->LastUse = TimeNow();
+  }
+  pthread_mutex_unlock( &ImageLock);
+  return Image;
+}
+
+static void ImageRelease( Sam9Image *Image) {
+  pthread_mutex_lock( &ImageLock);
+  Image->Users--;
+  pthread_mutex_unlock( &ImageLock);
+}
+
+// ----------------------------------------------------------------------------
+//  Board-farm daemon.  One worker thread owns each port and keeps a queue of
+//  flash jobs.  New jobs go to the least loaded port (or to the port named
+//  by the job), and a worker whose own queue is empty steals the newest job
+//  from the longest queue of another port, so a slow fixture never holds up
+//  work that an idle one could be doing.  Jobs arrive over a Unix socket as
+//  one parameter per line (-f, -a, -n, -j, -v and -p, as on the command
+//  line) ended by an empty line, and the reply is a single line:
+//
+//     pass <port> <bytes> <seconds>
+//     FAIL <port> <reason>
+// ----------------------------------------------------------------------------
+
+#define DAEMON_JOBS 64 // queued jobs per port
+
+struct Sam9Request {
+  Sam9Job Job;
+  Sam9Image *Image;
+  int Client;                         // socket the reply goes to
+  int Pinned;                         // port index the job must run on, or -1
+};
+
+struct Sam9Worker {
+  Sam9Session Session;
+  Sam9Request *Queue[DAEMON_JOBS];
+  bit32 Head, Tail;                   // free-running, masked on use
+  bool Busy;
+  pthread_t Thread;
+};
+
+static Sam9Worker *Workers = NULL;
+static int WorkerCount = 0;
+static pthread_mutex_t QueueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t QueueReady = PTHREAD_COND_INITIALIZER;
+
+static bool DaemonSubmit( Sam9Request *Request) {
+  pthread_mutex_lock( &QueueLock);
+  Sam9Worker *Target = NULL;
+  if (Request->Pinned >= 0) {
+    Target = &Workers[Request->Pinned];
+  } else {
+    for (int i = 0; i < WorkerCount; i++) {
+      Sam9Worker *Worker = &Workers[i];
+      if ((Target == NULL) || (Worker->Tail - Worker->Head + Worker->Busy < Target->Tail - Target->Head + Target->Busy)) {
+        Target = Worker;
+  } } }
+  bool Queued = Target->Tail - Target->Head < DAEMON_JOBS;
+  if (Queued) {
+    Target->Queue[Target->Tail++ & (DAEMON_JOBS - 1)] = Request;
+    pthread_cond_broadcast( &QueueReady);
+  }
+  pthread_mutex_unlock( &QueueLock);
+  return Queued;
+}
+
+static Sam9Request *DaemonTake( Sam9Worker *Worker) {
+  Sam9Request *Request = NULL;
+  pthread_mutex_lock( &QueueLock);
+  Worker->Busy = false;
+  while (Request == NULL) {
+    if (Worker->Head != Worker->Tail) {
+      Request = Worker->Queue[Worker->Head++ & (DAEMON_JOBS - 1)];
+    } else {
+      Sam9Worker *Victim = NULL;
+      for (int i = 0; i < WorkerCount; i++) {
+        Sam9Worker *Other = &Workers[i];
+        if ((Other->Head != Other->Tail) && (Other->Queue[(Other->Tail - 1) & (DAEMON_JOBS - 1)]->Pinned < 0)
+            && ((Victim == NULL) || (Other->Tail - Other->Head > Victim->Tail - Victim->Head))) {
+          Victim = Other;
+      } }
+      if (Victim) {
+        Request = Victim->Queue[--Victim->Tail & (DAEMON_JOBS - 1)];
+      } else {
+        pthread_cond_wait( &QueueReady, &QueueLock);
+  } } }
+  Worker->Busy = true;
+  pthread_mutex_unlock( &QueueLock);
+  return Request;
+}
+
+static void *DaemonWorker( void *Argument) {
+  Sam9Worker *Worker = (Sam9Worker *) Argument;
+  Sam9Session *Session = &Worker->Session;
+  while (true) {
+    Sam9Request *Request = DaemonTake( Worker);
+    Session->Job = Request->Job;
+    Session->SerialHead = Session->SerialTail = 0;
+    Session->FlagBinary = false;
+    Session->TurboDivisor = 0;
+    Session->MemoryCount = 0;
+    Session->Moved = 0;
+    if (Sam9RunSession( Session)) {
+      SocketReply( Request->Client, "pass %s %d %.2f\n", Session->Port, Session->Moved, Session->Seconds);
+    } else {
+      SocketReply( Request->Client, "FAIL %s job did not complete\n", Session->Port);
+    }
+    ImageRelease( Request->Image);
+    close( Request->Client);
+    free( Request);
+  }
+  return NULL;
+}
+
+// ----------------------------------------------------------------------------
+//  Read one job from a daemon client and queue it.  Anything wrong with the
+//  request is reported to the client straight away.
+// ----------------------------------------------------------------------------
+
+static void DaemonAccept( int Client) {
+  char Text[SOCKET_REQUEST];
+  if (SocketReadRequest( Client, Text) == false) {
+    SocketReply( Client, "FAIL - incomplete request\n");
+    close( Client);
+    return;
+  }
+  Sam9Request *Request = (Sam9Request *) calloc( 1, sizeof( Sam9Request));
+  Request->Client = Client;
+  Request->Pinned = -1;
+  Request->Job.Address = ValueAddrStart;
+  Request->Job.FlagSend = true;
+  ccptr Problem = NULL;
+  for (cptr Line = strtok( Text, "\n"); Line && (Problem == NULL); Line = strtok( NULL, "\n")) {
+    ccptr Value = ((Line[0] == '-') && Line[1] && (Line[2] == '=')) ? Line + 3 : NULL;
+    switch ((Line[0] == '-') ? Line[1] : 0) {
+      case 'f': Request->Job.FileName = Value; break;
+      case 'a': Request->Job.Address  = Value ? NumericValue( Value) : 0; break;
+      case 'n': Request->Job.Bytes    = Value ? NumericValue( Value) : 0; break;
+      case 'v': Request->Job.FlagVerify = true; break;
+      case 'j':
+        Request->Job.FlagJump = true;
+        Request->Job.AddrJump = Value ? NumericValue( Value) : Request->Job.Address;
+        break;
+      case 'p':
+        for (int i = 0; Value && (i < WorkerCount); i++) {
+          if (strcmp( Workers[i].Session.Port, Value) == 0) {
+            Request->Pinned = i;
+        } }
+        if (Request->Pinned < 0) {
+          Problem = "unknown port";
+        }
+        break;
+      default:
+        Problem = "invalid parameter";
+  } }
+  if ((Problem == NULL) && (Request->Job.FileName == NULL)) {
+    Problem = "-f required";
+  }
+  if ((Problem == NULL) && FileFormatOf( Request->Job.FileName)) {
+    Problem = "ELF, Intel HEX and S-record files are not supported, send a flat binary";
+  }
+  if ((Problem == NULL) && ((Request->Image = ImageAcquire( Request->Job.FileName, Request->Job.Bytes)) == NULL)) {
+    Problem = "unable to load file";
+  }
+  if (Problem == NULL) {
+    Request->Job.Image = Request->Image->Buffer;
+    Request->Job.Bytes = Request->Image->Count;
+    Request->Job.FileName = Request->Image->FileName;
+    if (DaemonSubmit( Request)) {
+      return;
+    }
+    ImageRelease( Request->Image);
+    Problem = "queue full";
+  }
+  SocketReply( Client, "FAIL - %s\n", Problem);
+  close( Client);
+  free( Request);
+}
+
+// ----------------------------------------------------------------------------
+//  Start one worker per port and serve jobs until killed.
+// ----------------------------------------------------------------------------
+
+static bool Sam9Daemon( ccptr SocketName) {
+  int Listener = SocketListen( SocketName);
+  if (Listener < 0) {
+    return false;
+  }
+  Workers = new Sam9Worker[PortCount]();
+  for (int i = 0; i < PortCount; i++) {
+    SessionSetup( &Workers[i].Session, PortNames[i], true);
+  }
+  WorkerCount = PortCount;
+  for (int i = 0; i < WorkerCount; i++) {
+    if (pthread_create( &Workers[i].Thread, NULL, DaemonWorker, &Workers[i])) {
+      fprintf( stderr, "*** Unable to start thread for '%s'!\n", PortNames[i]);
+      return false;
+  } }
+  setvbuf( stdout, NULL, _IOLBF, 0); // keep the log current when redirected
+  printf( "Serving %d port%s on socket '%s'.\n", WorkerCount, (WorkerCount == 1) ? "" : "s", SocketName);
+  while (true) {
+    int Client = accept( Listener, NULL, NULL);
+    if (Client >= 0) {
+      DaemonAccept( Client);
+    } else if (errno != EINTR) {
+      fprintf( stderr, "*** Unable to accept on socket '%s' (%s)!\n", SocketName, strerror( errno));
+      return false;
+  } }
+}
+
+// ----------------------------------------------------------------------------
+//  Submit the job described by -f, -a, -n, -j, -v and -p to a daemon and
+//  wait for the result.
+// ----------------------------------------------------------------------------
+
+static bool Sam9Submit( ccptr SocketName) {
+  int Server = SocketConnect( SocketName);
+  if (Server < 0) {
+    return false;
+  }
+  char Text[SOCKET_REQUEST], Path[PATH_MAX];
+  int Length = snprintf( Text, sizeof( Text), "-f=%s\n-a=0x%x\n", realpath( ParamFileName, Path) ? Path : ParamFileName, ValueAddrStart);
+  if (ParamBytes) {
+    Length += snprintf( Text + Length, sizeof( Text) - Length, "-n=%d\n", ValueBytes);
+  }
+  if (ParamAddrJump) {
+    Length += snprintf( Text + Length, sizeof( Text) - Length, "-j=0x%x\n", ValueAddrJump);
+  }
+  if (FlagVerify) {
+    Length += snprintf( Text + Length, sizeof( Text) - Length, "-v\n");
+  }
+  if (FlagPortGiven) {
+    Length += snprintf( Text + Length, sizeof( Text) - Length, "-p=%s\n", ParamPort);
+  }
+  Length += snprintf( Text + Length, sizeof( Text) - Length, "\n");
+  if (SocketExchange( Server, Text, Length) == false) {
+    fprintf( stderr, "*** Unable to send job to socket '%s'!\n", SocketName);
+    return false;
+  }
+  printf( "%s", Text);
+  return strncmp( Text, "pass ", 5) == 0;
+}
+
+// ----------------------------------------------------------------------------
+//  Session server.  Keeps one RomBOOT session open on one port so that
+//  scripts making many small requests pay for the handshake only once.
+//  Clients connect one at a time, which serializes concurrent clients, and
+//  send request lines ended by an empty line:
+//
+//     cpu                          ok <part id>
+//     peek <address> {<size>}      ok <value>
+//     poke <address> <value> {<size>}
+//     dump <address> <count>       hex dump lines, then ok
+//     go <address>
+//
+//  Each request is answered with a line starting 'ok' or 'FAIL'.  After a
+//  failed request (or a 'go') the session is re-synchronized before the
+//  next request and a failed request is tried once more, except a poke,
+//  which is never written twice.
+// ----------------------------------------------------------------------------
+
+static bool ServerResync( Sam9Session *Session) {
+  Sam9SetSerialMode( Session, Session->Options.Baud);
+  Session->TurboDivisor = 0;
+  Session->FlagBinary = false;
+  Sam9Discard( Session);
+  Sam9Handshake( Session, false);
+  return Sam9Sync( Session);
+}
+
+static bool ServerRequest( Sam9Session *Session, cptr Line, fptr Reply, bool &Stale) {
+  char *Save = NULL;
+  ccptr Command = strtok_r( Line, " ,\t", &Save);
+  ccptr Argument[3] = { NULL, NULL, NULL };
+  for (int i = 0; i < 3; i++) {
+    Argument[i] = strtok_r( NULL, " ,\t", &Save);
+  }
+  bit32 Value;
+  if (Command == NULL) {
+    return true;
+  } else if (strcmp( Command, "cpu") == 0) {
+    if (Session->PartId( Value)) {
+      fprintf( Reply, "ok 0x%8.8X\n", Value);
+      return true;
+    }
+  } else if ((strcmp( Command, "peek") == 0) && Argument[0]) {
+    int Size = Argument[1] ? NumericValue( Argument[1]) : 4;
+    if (((Size == 1) || (Size == 2) || (Size == 4)) && Sam9Read( Session, NumericValue( Argument[0]), Size, Value, false)) {
+      fprintf( Reply, "ok 0x%*.*X\n", Size * 2, Size * 2, Value);
+      return true;
+    }
+  } else if ((strcmp( Command, "poke") == 0) && Argument[1]) {
+    int Size = Argument[2] ? NumericValue( Argument[2]) : 4;
+    if ((Size == 1) || (Size == 2) || (Size == 4)) {
+      Sam9Write( Session, NumericValue( Argument[0]), Size, NumericValue( Argument[1]), false);
+      if (Sam9Sync( Session)) { // writes may be silent, make sure RomBOOT is still there
+        fprintf( Reply, "ok\n");
+      } else { // not tried again, the register may have side effects
+        fprintf( Reply, "FAIL target unresponsive\n");
+        Stale = true;
+      }
+      return true;
+    }
+  } else if ((strcmp( Command, "dump") == 0) && Argument[1]) {
+    bit32 Address = NumericValue( Argument[0]), Count = NumericValue( Argument[1]);
+    bool Success = (Count > 0) && LoadMemory( Session, Address, Count);
+    if (Success) {
+      DumpMemory( Reply, Address, Session->MemoryBuffer, Count);
+      fprintf( Reply, "ok\n");
+    }
+    free( Session->MemoryBuffer);
+    Session->MemoryBuffer = NULL;
+    Session->MemoryCount = 0;
+    return Success;
+  } else if ((strcmp( Command, "go") == 0) && Argument[0]) {
+    Session->Go( NumericValue( Argument[0]));
+    fprintf( Reply, "ok\n");
+    Stale = true; // RomBOOT is gone until the board is reset
+    return true;
+  } else {
+    fprintf( Reply, "FAIL unknown request '%s'\n", Command);
+    return true;
+  }
+  return false;
+}
+
+static bool Sam9Server( ccptr SocketName) {
+  Sam9Session *Session = new Sam9Session();
+  SessionSetup( Session, PortNames[0], false);
+  int Listener = SocketListen( SocketName);
+  if ((Listener < 0) || (Sam9Open( Session, FlagQuiet == false) == false)) {
+    return false;
+  }
+  bool Stale = Sam9Sync( Session) == false;
+  if (Stale) {
+    fprintf( stderr, "*** Target on '%s' not responding, will retry on the first request!\n", Session->Port);
+  }
+  setvbuf( stdout, NULL, _IOLBF, 0); // keep the log current when redirected
+  printf( "\nServing '%s' on socket '%s'.\n", Session->Port, SocketName);
+  while (true) {
+    int Client = accept( Listener, NULL, NULL);
+    if (Client < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf( stderr, "*** Unable to accept on socket '%s' (%s)!\n", SocketName, strerror( errno));
+      return false;
+    }
+    char Text[SOCKET_REQUEST];
+    if (SocketReadRequest( Client, Text) == false) {
+      SocketReply( Client, "FAIL incomplete request\n");
+      close( Client);
+      continue;
+    }
+    fptr Reply = fdopen( Client, "w");
+    char *Save = NULL;
+    for (cptr Line = strtok_r( Text, "\n", &Save); Line; Line = strtok_r( NULL, "\n", &Save)) {
+      char Copy[SOCKET_REQUEST];
+      strcpy( Copy, Line);
+      if ((Stale == false) || (Stale = ServerResync( Session) == false)) {
+        if (ServerRequest( Session, Line, Reply, Stale)) {
+          fflush( Reply);
+          continue;
+      } }
+      if ((Stale = ServerResync( Session) == false) || (ServerRequest( Session, Copy, Reply, Stale) == false)) {
+        fprintf( Reply, "FAIL target unresponsive\n");
+        Stale = true;
+      }
+      fflush( Reply);
+    }
+    fclose( Reply);
+} }
+
+// ----------------------------------------------------------------------------
+//  Send the requests given on the command line to a session server and show
+//  the replies.  Fails if any request failed.
+// ----------------------------------------------------------------------------
+
+static bool Sam9Connect( ccptr SocketName) {
+  int Server = SocketConnect( SocketName);
+  if (Server < 0) {
+    return false;
+  }
+  char Text[SOCKET_REQUEST];
+  int Length = 0;
+  if (FlagCpu) {
+    Length += snprintf( Text + Length, sizeof( Text) - Length, "cpu\n");
+  }
+  for (int i = 0; i < ServerRequestCount; i++) {
+    Length += snprintf( Text + Length, sizeof( Text) - Length, "%s\n", ServerRequests[i]);
+  }
+  if (FlagDump) {
+    Length += snprintf( Text + Length, sizeof( Text) - Length, "dump 0x%x %d\n", ValueAddrStart, ValueBytes);
+  }
+  if (ParamAddrJump) {
+    Length += snprintf( Text + Length, sizeof( Text) - Length, "go 0x%x\n", ValueAddrJump);
+  }
+  Length += snprintf( Text + Length, sizeof( Text) - Length, "\n");
+  if (FileWriteBlock( Server, Text, Length) == false) {
+    fprintf( stderr, "*** Unable to send requests to socket '%s'!\n", SocketName);
+    close( Server);
+    return false;
+  }
+  bool Success = true;
+  fptr Replies = fdopen( Server, "r");
+  while (fgets( Text, sizeof( Text), Replies)) {
+    printf( "%s", Text);
+    if (strncmp( Text, "FAIL", 4) == 0) {
+      Success = false;
+  } }
+  fclose( Replies);
+  return Success;
+}
+
+// ----------------------------------------------------------------------------
+//  Main application.
+// ----------------------------------------------------------------------------
+
+int main( int argc, ccptr argv[]) {
+  printf( "\nSAM9 Boot Utility Version " VERSION "\n");
+  bool Success = true;
+  if (argc > 1) {
+    if (ParseParameters( argc, argv)) {
+      printf( "\n");
+      FileNumberConsole = fileno( stdin);
+      if (ParamSubmit) {
+        return Sam9Submit( ParamSubmit) ? 0 : 1;
+      }
+      if (ParamConnect) {
+        return Sam9Connect( ParamConnect) ? 0 : 1;
+      }
+
+      //---------------------------------
+      //  send/verify - load file image
+      //---------------------------------
+
+      if (FlagSend | FlagVerify) {
+        if (ParamFileName && FileIsStream( ParamFileName)) {
+          if ((FlagSend == false) || FlagReceive || FlagInteractive || FlagAsync || FlagBench || FlagDelta || FlagSparse || FlagCompress || FlagResume || ParamDaemon || ParamServer || (PortCount > 1)) {
+            printf( "*** A file read as it is sent (-f=- or a pipe) needs '-s' and a single port, and no '-r', '-i', '--async', '--bench', '--delta', '--sparse', '--compress', '--resume', '--daemon' or '--server'!\n");
+            Success = false;
+          } else if ((Success = StreamStart( ParamFileName))) {
+            printf( "Reading file '%s' from %s as it is sent.\n", ParamFileName, strcmp( ParamFileName, "-") ? "a pipe" : "stdin");
+          }
+        } else if (ParamFileName) {
+          if (LoadFile( ParamFileName) == false) {
+            Success = false;
+          } else if (FileSegmentCount == 0) {
+            printf( "Loaded file '%s' (%d bytes) from disk.\n", ParamFileName, ValueBytes);
+          } else if (FlagAsync || FlagBench) {
+            printf( "*** Parameters '--async' and '--bench' need a flat binary file!\n");
+            Success = false;
+          } else {
+            bit32 Zero = 0;
+            for (int i = 0; i < FileSegmentCount; i++) {
+              Zero += FileSegments[i].Zero;
+            }
+            printf( "Loaded %s file '%s' (%d segments, %d bytes, %d zero-filled, entry $%x) from disk.\n", FileFormat, ParamFileName, FileSegmentCount, ValueBytes, Zero, FileEntry);
+            if (FlagJumpDefault) {
+              ValueAddrJump = FileEntry;
+            }
+            Success = SegmentsClearOfApplet();
+          }
+        } else {
+          printf( "*** Parameters '-s' and '-v' require '-f'!\n");
+          Success = false;
+      } }
+
+      //------------------------
+      //  one session per port
+      //------------------------
+
+      if (Success && ParamDaemon) {
+        Success = Sam9Daemon( ParamDaemon);
+      } else if (Success && ParamServer) {
+        Success = Sam9Server( ParamServer);
+      } else if (Success) {
+        Sam9Session *Sessions = new Sam9Session[PortCount]();
+        for (int i = 0; i < PortCount; i++) {
+          SessionSetup( &Sessions[i], PortNames[i], PortCount > 1);
+          Sessions[i].FlagProgress = PortCount == 1;
+          Sessions[i].Job.FileName = ParamFileName;
+          Sessions[i].Job.Image = FileBuffer;
+          Sessions[i].Job.Bytes = ValueBytes;
+          Sessions[i].Job.Address = ValueAddrStart;
+          Sessions[i].Job.AddrJump = ValueAddrJump;
+          Sessions[i].Job.FlagJump = ParamAddrJump != NULL;
+          Sessions[i].Job.FlagSend = FlagSend;
+          Sessions[i].Job.FlagVerify = FlagVerify;
+          Sessions[i].Job.FlagDelta = FlagDelta;
+          Sessions[i].Job.FlagCrc = FlagCrc;
+          Sessions[i].Job.FlagSparse = FlagSparse;
+          Sessions[i].Job.FlagCompress = FlagCompress;
+          Sessions[i].Job.FlagResume = FlagResume;
+          Sessions[i].Job.Stage = ValueStage;
+          Sessions[i].Job.Segments = FileSegmentCount ? FileSegments : NULL;
+          Sessions[i].Job.SegmentCount = FileSegmentCount;
+        }
+        if (FlagBench) {
+          Success = Sam9Bench( Sessions, PortCount);
+        } else if (FlagAsync) {
+          Success = Sam9RunAsync( Sessions, PortCount);
+        } else if (PortCount > 1) {
+          Success = Sam9RunSessions( Sessions, PortCount);
+        } else {
+          Success = Sam9RunSession( Sessions);
+          printf( "\n");
+        }
+        delete[] Sessions;
     } }
   } else {
     ShowHelp( argv[0]);
@@ -0,0 +1,1165 @@
+// ----------------------------------------------------------------------------
+// sam9lib - Atmel SAM9 SAM-BA RomBOOT session library.
+// ----------------------------------------------------------------------------
+//
+//   Copyright 2011 Michael E. Nagy
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+// ----------------------------------------------------------------------------
+//
+// Everything that talks to RomBOOT over a serial port: port setup, command
+// framing, pipelined word access, DBGU rate switching and XMODEM transfers.
+// Built into libsam9boot.a, see sam9lib.h for the interface.
+//
+// ----------------------------------------------------------------------------
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <termios.h>
+#include <errno.h>
+
+#include <fcntl.h>
+
+#include "sam9lib.h"
+#include "sam9uring.h"
+
+// ----------------------------------------------------------------------------
+//  Write a block of bytes to the RomBOOT serial port, retrying as needed
+//  until the entire block has been accepted by the driver.
+// ----------------------------------------------------------------------------
+
+bool FileWriteBlock( int FileNumber, const void *Data, int Count) {
+  const byte *p = (const byte *) Data;
+  while (Count > 0) {
+    int r = write( FileNumber, p, Count);
+    if (r <= 0) {
+      return false;
+    }
+    p += r;
+    Count -= r;
+  }
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+//  Write a block to a session's port through its transport.  Without
+//  io_uring this is a write() per block, with it the block is queued and
+//  goes out with the next wait for input.
+// ----------------------------------------------------------------------------
+
+bool Sam9Send( Sam9Session *Session, const void *Data, int Count) {
+  if (Session->Uring) {
+    return Sam9UringWrite( Session, Data, Count);
+  }
+  const byte *p = (const byte *) Data;
+  while (Count > 0) {
+    Session->Syscalls++;
+    int r = write( Session->FileNumber, p, Count);
+    if (r <= 0) {
+      return false;
+    }
+    p += r;
+    Count -= r;
+  }
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+//  Push formatted commands all the way to the driver, used before anything
+//  that must not overtake them (a rate change).
+// ----------------------------------------------------------------------------
+
+void Sam9Flush( Sam9Session *Session) {
+  fflush( Session->FileHandle);
+  if (Session->Uring) {
+    Sam9UringFlush( Session);
+} }
+
+// ----------------------------------------------------------------------------
+//  Return the current time in seconds, used for throughput reporting.
+// ----------------------------------------------------------------------------
+
+double TimeNow( void) {
+  struct timeval tv;
+  gettimeofday( &tv, NULL);
+  return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+// ----------------------------------------------------------------------------
+//  Buffered sam9 serial input.  Rather than one read() per character, input
+//  is pulled from the driver in bulk into a ring buffer whenever it runs dry
+//  (a poll() for readiness and then one read() of everything available),
+//  and characters are served from the buffer.  Replies, XMODEM blocks and
+//  terminal output all come through here.
+// ----------------------------------------------------------------------------
+
+// ----------------------------------------------------------------------------
+//  Number of characters waiting in the serial input buffer.
+// ----------------------------------------------------------------------------
+
+int Sam9Buffered( Sam9Session *Session) {
+  return Session->SerialHead - Session->SerialTail;
+}
+
+// ----------------------------------------------------------------------------
+//  Add whatever the driver has to the serial input buffer, optionally after
+//  waiting up to the specified number of milliseconds for sam9 input to
+//  arrive.  Returns the number of characters added, zero on timeout or when
+//  the buffer is full.
+// ----------------------------------------------------------------------------
+
+int Sam9ReadAvailable( Sam9Session *Session) {
+  if (Session->Uring) {
+    return Sam9UringFill( Session, 0);
+  }
+  int Space = SERIAL_BUFFER - Sam9Buffered( Session);
+  bit32 Head = Session->SerialHead & (SERIAL_BUFFER - 1);
+  if (Space > (int) (SERIAL_BUFFER - Head)) {
+    Space = SERIAL_BUFFER - Head; // contiguous part, the rest on the next fill
+  }
+  if (Space <= 0) {
+    return 0;
+  }
+  Session->Syscalls++;
+  int r = read( Session->FileNumber, Session->SerialBuffer + Head, Space);
+  if (r <= 0) {
+    return 0;
+  }
+  Session->SerialHead += r;
+  return r;
+}
+
+static int Sam9Fill( Sam9Session *Session, int Milliseconds) {
+  struct pollfd pfd;
+  if (Sam9Buffered( Session) >= SERIAL_BUFFER) {
+    return 0;
+  }
+  if (Session->Uring) {
+    return Sam9UringFill( Session, Milliseconds);
+  }
+  Session->Syscalls++;
+  pfd.fd = Session->FileNumber;
+  pfd.events = POLLIN;
+  if (poll( &pfd, 1, Milliseconds) <= 0) {
+    return 0;
+  }
+  return Sam9ReadAvailable( Session);
+}
+
+// ----------------------------------------------------------------------------
+//  Return one character from the RomBOOT serial port, or -1 if none arrives
+//  within the specified number of milliseconds.
+// ----------------------------------------------------------------------------
+
+static int Sam9GetByte( Sam9Session *Session, int Milliseconds) {
+  if ((Sam9Buffered( Session) == 0) && (Sam9Fill( Session, Milliseconds) == 0)) {
+    return -1;
+  }
+  return Session->SerialBuffer[Session->SerialTail++ & (SERIAL_BUFFER - 1)];
+}
+
+// ----------------------------------------------------------------------------
+//  Copy up to Count characters from the RomBOOT serial port, waiting up to
+//  the specified number of milliseconds for each refill.  Returns the
+//  number of characters copied.
+// ----------------------------------------------------------------------------
+
+static int Sam9GetBlock( Sam9Session *Session, bptr Data, int Count, int Milliseconds) {
+  int Length = 0;
+  while (Length < Count) {
+    if ((Sam9Buffered( Session) == 0) && (Sam9Fill( Session, Milliseconds) == 0)) {
+      break;
+    }
+    bit32 Tail = Session->SerialTail & (SERIAL_BUFFER - 1);
+    int Chunk = Sam9Buffered( Session);
+    if (Chunk > (int) (SERIAL_BUFFER - Tail)) {
+      Chunk = SERIAL_BUFFER - Tail;
+    }
+    if (Chunk > Count - Length) {
+      Chunk = Count - Length;
+    }
+    memcpy( Data + Length, Session->SerialBuffer + Tail, Chunk);
+    Session->SerialTail += Chunk;
+    Length += Chunk;
+  }
+  return Length;
+}
+
+// ----------------------------------------------------------------------------
+//  Standard serial rates and their termios speed codes.
+// ----------------------------------------------------------------------------
+
+static const struct { bit32 Rate; speed_t Speed; } StandardRates[] = {
+  {     1200, B1200    }, {     2400, B2400    }, {     4800, B4800    },
+  {     9600, B9600    }, {    19200, B19200   }, {    38400, B38400   },
+  {    57600, B57600   }, {   115200, B115200  }, {   230400, B230400  },
+#ifdef B460800
+  {   460800, B460800  }, {   500000, B500000  }, {   576000, B576000  },
+  {   921600, B921600  }, {  1000000, B1000000 }, {  1152000, B1152000 },
+  {  1500000, B1500000 }, {  2000000, B2000000 }, {  2500000, B2500000 },
+  {  3000000, B3000000 }, {  3500000, B3500000 }, {  4000000, B4000000 },
+#endif
+};
+
+// ----------------------------------------------------------------------------
+//  The Linux termios2 interface allows arbitrary rates via BOTHER.  The
+//  kernel structure is declared locally because its header clashes with
+//  <termios.h>.
+// ----------------------------------------------------------------------------
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+
+struct Sam9Termios2 {
+  tcflag_t c_iflag, c_oflag, c_cflag, c_lflag;
+  cc_t c_line;
+  cc_t c_cc[19];
+  speed_t c_ispeed, c_ospeed;
+};
+
+#define SAM9_TCGETS2 _IOR( 'T', 0x2A, struct Sam9Termios2)
+#define SAM9_TCSETS2 _IOW( 'T', 0x2B, struct Sam9Termios2)
+#define SAM9_BOTHER  0010000
+#endif
+
+// ----------------------------------------------------------------------------
+//  Set up the sam9 serial port for raw i/o at the requested rate.  Raw mode
+//  is required so that binary XMODEM blocks pass through the driver
+//  unmodified.  Standard rates are set with the usual termios calls, others
+//  with termios2/BOTHER where the kernel supports it.  The rate is then read
+//  back from the driver and returned, zero if it could not be set.
+// ----------------------------------------------------------------------------
+
+bit32 Sam9SetSerialMode( Sam9Session *Session, bit32 Rate) {
+  struct termios Sam9TermIOs;
+  speed_t Speed = B0;
+  for (unsigned i = 0; i < sizeof( StandardRates) / sizeof( StandardRates[0]); i++) {
+    if (StandardRates[i].Rate == Rate) {
+      Speed = StandardRates[i].Speed;
+  } }
+  tcgetattr( Session->FileNumber, &Sam9TermIOs);
+  cfmakeraw( &Sam9TermIOs);
+  Sam9TermIOs.c_cflag |= CLOCAL | CREAD;
+  cfsetispeed( &Sam9TermIOs, (Speed == B0) ? B115200 : Speed);
+  cfsetospeed( &Sam9TermIOs, (Speed == B0) ? B115200 : Speed);
+  if (tcsetattr( Session->FileNumber, TCSANOW, &Sam9TermIOs)) {
+    return 0;
+  }
+#ifdef __linux__
+  struct Sam9Termios2 Sam9TermIOs2;
+  if (ioctl( Session->FileNumber, SAM9_TCGETS2, &Sam9TermIOs2)) {
+    return (Speed == B0) ? 0 : Rate; // no termios2, trust the standard rate
+  }
+  if (Speed == B0) {
+    Sam9TermIOs2.c_cflag &= ~(CBAUD | (CBAUD << 16)); // output and input rate codes
+    Sam9TermIOs2.c_cflag |= SAM9_BOTHER | (SAM9_BOTHER << 16);
+    Sam9TermIOs2.c_ispeed = Rate;
+    Sam9TermIOs2.c_ospeed = Rate;
+    if (ioctl( Session->FileNumber, SAM9_TCSETS2, &Sam9TermIOs2) || ioctl( Session->FileNumber, SAM9_TCGETS2, &Sam9TermIOs2)) {
+      return 0;
+  } }
+  return Sam9TermIOs2.c_ospeed;
+#else
+  return (Speed == B0) ? 0 : Rate;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+//  Catch any response from RomBOOT and display it unless the quiet flag is
+//  set.  Characters are collected until the reply is complete according to
+//  the frame type or the deadline (idle time for a drain) expires, so that
+//  a reply is returned as soon as its last byte arrives.  If the response is
+//  a valid hex number, return the value.
+// ----------------------------------------------------------------------------
+
+bit32 GetResponse( Sam9Session *Session, bool FlagTrace, int Frame, int Milliseconds) {
+  char Response[64];
+  enum { StateLead, StateText, StateEnd } State = StateLead;
+  double Deadline = TimeNow() + (Milliseconds / 1000.0);
+  char Last = 0;
+  int n = 0;
+  bit32 Value = 0;
+  Session->ResponseCount = 0;
+  Session->ResponseFramed = false;
+  while (Session->ResponseFramed == false) {
+    int Wait = Milliseconds;
+    if (Frame != FRAME_DRAIN) {
+      if ((Wait = (int) ((Deadline - TimeNow()) * 1000.0 + 0.5)) < 0) {
+        break;
+    } }
+    int Next = Sam9GetByte( Session, Wait);
+    if (Next < 0) {
+      break;
+    }
+    char c = Next;
+    if (n < (int) sizeof( Response) - 1) {
+      Response[n++] = c;
+    }
+    Session->ResponseCount++;
+    switch (Frame) {
+      case FRAME_DRAIN:
+        break;
+      case FRAME_PROMPT:
+        Session->ResponseFramed = (c == '>');
+        break;
+      case FRAME_LINE:
+        switch (State) {
+          case StateLead: if ((c != '\r') && (c != '\n')) State = StateText;  break;
+          case StateText: if ((c == '\r') || (c == '\n')) State = StateEnd;   break;
+          case StateEnd:
+            if (((c == '\r') || (c == '\n')) && (c != Last)) {
+              Session->ResponseFramed = true;
+            } else if ((c != '\r') && (c != '\n')) {
+              State = StateText;
+            }
+            break;
+        }
+        break;
+      default:
+        Session->ResponseFramed = (Session->ResponseCount == (bit32) Frame);
+        break;
+    }
+    Last = c;
+  }
+  if (n && (Frame > 0)) { // binary little-endian value
+    for (int i = n; i--; ) {
+      Value = (Value << 8) | (byte) Response[i];
+    }
+    if (FlagTrace) {
+      printf( "[0x%X]", Value);
+    }
+  } else if (n) { // text, look for 0x followed by hex digits
+    int State = 0;
+    Response[n] = 0;
+    if (FlagTrace) {
+      printf( "%s", Response);
+    }
+    for (int i = 0; (i < n) && (State < 3); i++) {
+      char c = Response[i];
+      switch (State) {
+        case 0: if (c == '0') State = 1;                 break;
+        case 1: State = (c == 'x') ? 2 : (c == '0') ? 1 : 0; break;
+        case 2:
+          if      ((c >= '0') && (c <= '9')) Value = (Value << 4) | (c - '0');
+          else if ((c >= 'A') && (c <= 'F')) Value = (Value << 4) | (c - 'A' + 10);
+          else if ((c >= 'a') && (c <= 'f')) Value = (Value << 4) | (c - 'a' + 10);
+          else State = 3;
+          break;
+  } } }
+  return Value;
+}
+
+// ----------------------------------------------------------------------------
+//  Wait for the end of a command that returns no data.  In terminal mode
+//  every command is echoed and ends with a prompt, in non-interactive
+//  (binary) mode selected by 'N#' nothing is echoed, writes are silent and
+//  reads return raw little-endian bytes.
+// ----------------------------------------------------------------------------
+
+static void Sam9CommandDone( Sam9Session *Session, bool FlagTrace) {
+  if (Session->FlagBinary == false) {
+    GetResponse( Session, FlagTrace);
+} }
+
+// ----------------------------------------------------------------------------
+//  Switch RomBOOT between non-interactive (binary) and terminal mode.
+// ----------------------------------------------------------------------------
+
+void Sam9SetBinaryMode( Sam9Session *Session, bool Binary, bool FlagTrace) {
+  fprintf( Session->FileHandle, "%s#\n", Binary ? "N" : "T");
+  fflush( Session->FileHandle);
+  if (FlagTrace) {
+    printf( "%s#", Binary ? "N" : "T");
+  }
+  GetResponse( Session, FlagTrace, Binary ? FRAME_DRAIN : FRAME_PROMPT, Binary ? RESPONSE_IDLE_MS : RESPONSE_MS);
+  Session->FlagBinary = Binary;
+}
+
+// ----------------------------------------------------------------------------
+//  Encode a RomBOOT memory access command.  The command letter selects read
+//  ('o', 'h', 'w') or write ('O', 'H', 'W'), the value is ignored for reads.
+//  Each command is followed by Pad newlines, which RomBOOT ignores.  Returns
+//  the length of the command text, which is not terminated.
+// ----------------------------------------------------------------------------
+
+int Sam9Encode( char *Text, char Command, bit32 Address, int Size, bit32 Value, int Pad) {
+  int Length;
+  if ((Command >= 'a') && (Command <= 'z')) {
+    Length = sprintf( Text, "%c%5.5X,%d#", Command, Address, Size);
+  } else {
+    Length = sprintf( Text, "%c%5.5X,%*.*X#", Command, Address, Size*2, Size*2, Value);
+  }
+  while (Pad--) {
+    Text[Length++] = '\n';
+  }
+  return Length;
+}
+
+// ----------------------------------------------------------------------------
+//  Issue a RomBOOT memory access command without waiting for the reply.
+// ----------------------------------------------------------------------------
+
+static void Sam9IssueText( Sam9Session *Session, const char *Text, int Length, bool FlagTrace) {
+  fwrite( Text, 1, Length, Session->FileHandle);
+  if (FlagTrace) {
+    printf( "%.*s", (int) ((const char *) memchr( Text, '#', Length) + 1 - Text), Text); // not the padding
+} }
+
+static void Sam9Issue( Sam9Session *Session, char Command, bit32 Address, int Size, bit32 Value, int Pad, bool FlagTrace) {
+  char Text[SAM9_COMMAND_MAX];
+  Sam9IssueText( Session, Text, Sam9Encode( Text, Command, Address, Size, Value, Pad), FlagTrace);
+}
+
+// ----------------------------------------------------------------------------
+//  Read a byte, halfword or word of target memory with the RomBOOT 'o', 'h'
+//  or 'w' command.  Returns false if the reply was incomplete.
+// ----------------------------------------------------------------------------
+
+bool Sam9Read( Sam9Session *Session, bit32 Address, int Size, bit32 &Value, bool FlagTrace) {
+  Sam9Issue( Session, (Size == 4) ? 'w' : (Size == 2) ? 'h' : 'o', Address, Size, 0, 1, FlagTrace);
+  Value = GetResponse( Session, FlagTrace, Session->FlagBinary ? Size : FRAME_PROMPT);
+  return Session->ResponseFramed;
+}
+
+// ----------------------------------------------------------------------------
+//  Write a byte, halfword or word of target memory with the RomBOOT 'O', 'H'
+//  or 'W' command.
+// ----------------------------------------------------------------------------
+
+void Sam9Write( Sam9Session *Session, bit32 Address, int Size, bit32 Value, bool FlagTrace) {
+  Sam9Issue( Session, (Size == 4) ? 'W' : (Size == 2) ? 'H' : 'O', Address, Size, Value, 1, FlagTrace);
+  Sam9CommandDone( Session, FlagTrace);
+}
+
+// ----------------------------------------------------------------------------
+//  Pipelined memory access.  Rather than waiting for each reply before the
+//  next command, up to Options.Window word (or trailing byte) commands are kept
+//  in flight and the replies, which RomBOOT always sends in order, are
+//  matched to them as they arrive.
+//
+//  The DBGU receiver holds a single character, so anything arriving while
+//  RomBOOT is busy sending a reply is overrun.  Each pipelined command is
+//  therefore followed by enough ignored newlines to cover the length of its
+//  reply, and only newlines are lost.  If a reply is missing or damaged the
+//  line is drained, the window is halved and everything from the failed
+//  command on is reissued.  The window grows back by one after each full
+//  window of good replies.
+//
+//  In non-interactive mode writes have no reply at all, so each window of
+//  them is followed by a read of the last word (or byte) written as a
+//  checkpoint.  If that reply is missing or wrong the window is reissued
+//  from the last good checkpoint at half the size, as above.
+// ----------------------------------------------------------------------------
+
+typedef void (*ProgressFunction)( Sam9Session *Session, bit32 Length);
+
+int PipelinePad( Sam9Session *Session, bool Write, int Size, bit32 Window) {
+  if (Window < 2) {
+    return 1;
+  }
+  if (Session->FlagBinary) {
+    return Write ? 1 : Size + 1;
+  }
+  return Write ? 3 + 1 : 7 + (Size * 2) + 1; // "\n\r>" or "\n\r0x...\n\r>"
+}
+
+// ----------------------------------------------------------------------------
+//  Pipeline bookkeeping, shared with the coroutine sessions so that both
+//  follow the same rules.  PipelineIssue() and PipelineCheckpoint() encode
+//  the next command (or the checkpoint read) into Text and return its
+//  length.  PipelineReply() takes the reply to the oldest command in flight,
+//  or to the checkpoint, and returns false if it was wrong.  PipelineFailed()
+//  rewinds to the last confirmed command with half the window, or returns
+//  false after too many retries; the caller drains the line.
+// ----------------------------------------------------------------------------
+
+void PipelineStart( Sam9Session *Session, Sam9Pipe &Pipe, bool Write, bit32 Address, bptr Buffer, bit32 Count) {
+  Pipe.Write = Write;
+  Pipe.Checkpoint = Write && Session->FlagBinary;
+  Pipe.Address = Address;
+  Pipe.Buffer = Buffer;
+  Pipe.Words = Count / 4;
+  Pipe.Total = Pipe.Words + (Count % 4);
+  Pipe.Issued = 0;
+  Pipe.Done = 0;
+  Pipe.Window = Session->Options.Window ? Session->Options.Window : 1;
+  Pipe.Good = 0;
+  Pipe.Retry = 0;
+}
+
+bit32 PipelineOffset( const Sam9Pipe &Pipe, bit32 Index) {
+  return (Index < Pipe.Words) ? Index * 4 : Index + (Pipe.Words * 3);
+}
+
+int PipelineSize( const Sam9Pipe &Pipe, bit32 Index) {
+  return (Index < Pipe.Words) ? 4 : 1;
+}
+
+bool PipelineRoom( const Sam9Pipe &Pipe) {
+  return (Pipe.Issued < Pipe.Total) && (Pipe.Issued - Pipe.Done < Pipe.Window);
+}
+
+int PipelineIssue( Sam9Session *Session, Sam9Pipe &Pipe, char *Text) {
+  bit32 Offset = PipelineOffset( Pipe, Pipe.Issued), Value = 0;
+  int Size = PipelineSize( Pipe, Pipe.Issued);
+  if (Pipe.Write) {
+    for (int i = 0; i < Size; i++) {
+      Value |= Pipe.Buffer[Offset + i] << (i*8);
+  } }
+  Pipe.Issued++;
+  return Sam9Encode( Text, Pipe.Write ? ((Size == 4) ? 'W' : 'O') : ((Size == 4) ? 'w' : 'o'), Pipe.Address + Offset, Size, Value, PipelinePad( Session, Pipe.Write, Size, Pipe.Window));
+}
+
+int PipelineCheckpoint( Sam9Session *Session, Sam9Pipe &Pipe, char *Text) {
+  int Size = PipelineSize( Pipe, Pipe.Issued - 1);
+  return Sam9Encode( Text, (Size == 4) ? 'w' : 'o', Pipe.Address + PipelineOffset( Pipe, Pipe.Issued - 1), Size, 0, PipelinePad( Session, false, Size, Pipe.Window));
+}
+
+bool PipelineReply( Sam9Session *Session, Sam9Pipe &Pipe, bit32 Value) {
+  if (Pipe.Checkpoint) { // the last write read back, so all before it are done
+    bit32 Offset = PipelineOffset( Pipe, Pipe.Issued - 1);
+    for (int i = 0; i < PipelineSize( Pipe, Pipe.Issued - 1); i++) {
+      if (Pipe.Buffer[Offset + i] != ((Value >> (i*8)) & 0xff)) {
+        return false;
+    } }
+    Pipe.Done = Pipe.Issued;
+    if (Pipe.Window < Session->Options.Window) {
+      Pipe.Window++;
+    }
+  } else {
+    if (Pipe.Write == false) {
+      bit32 Offset = PipelineOffset( Pipe, Pipe.Done);
+      for (int i = 0; i < PipelineSize( Pipe, Pipe.Done); i++) {
+        Pipe.Buffer[Offset + i] = Value & 0xff;
+        Value >>= 8;
+    } }
+    Pipe.Done++;
+    if ((++Pipe.Good >= Pipe.Window) && (Pipe.Window < Session->Options.Window)) {
+      Pipe.Window++;
+      Pipe.Good = 0;
+  } }
+  Pipe.Retry = 0;
+  return true;
+}
+
+bool PipelineFailed( Sam9Pipe &Pipe) {
+  if (++Pipe.Retry > PIPELINE_RETRIES) {
+    return false;
+  }
+  Pipe.Window = (Pipe.Window > 1) ? Pipe.Window / 2 : 1;
+  Pipe.Good = 0;
+  Pipe.Issued = Pipe.Done;
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+//  Run one transfer through the pipeline, with progress every 256 bytes.
+// ----------------------------------------------------------------------------
+
+static bool Sam9Pipeline( Sam9Session *Session, bool Write, bit32 Address, bptr Buffer, bit32 Count, ProgressFunction Progress, bit32 ProgressBase) {
+  char Text[SAM9_COMMAND_MAX];
+  Sam9Pipe Pipe;
+  PipelineStart( Session, Pipe, Write, Address, Buffer, Count);
+  while (Pipe.Done < Pipe.Total) {
+    while (PipelineRoom( Pipe)) {
+      Sam9IssueText( Session, Text, PipelineIssue( Session, Pipe, Text), Session->Options.Trace);
+    }
+    bit32 Before = PipelineOffset( Pipe, Pipe.Done);
+    int Size = PipelineSize( Pipe, Pipe.Checkpoint ? Pipe.Issued - 1 : Pipe.Done);
+    if (Pipe.Checkpoint) { // silent binary writes, read the last one back
+      Sam9IssueText( Session, Text, PipelineCheckpoint( Session, Pipe, Text), Session->Options.Trace);
+    }
+    fflush( Session->FileHandle);
+    bit32 Value = GetResponse( Session, Session->Options.Trace, Session->FlagBinary ? Size : FRAME_PROMPT);
+    if (Session->ResponseFramed && PipelineReply( Session, Pipe, Value)) {
+      bit32 After = PipelineOffset( Pipe, Pipe.Done);
+      if (Progress && ((Before / 256) != (After / 256))) {
+        Progress( Session, ProgressBase + After);
+      }
+    } else if (PipelineFailed( Pipe)) {
+      GetResponse( Session, Session->Options.Trace, FRAME_DRAIN, PIPELINE_DRAIN_MS);
+      if (Session->Options.Trace) {
+        printf( "[window %d]", Pipe.Window);
+      }
+    } else {
+      return false;
+  } }
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+//  Discard any sam9 input, both buffered and still in the driver.
+// ----------------------------------------------------------------------------
+
+void Sam9Discard( Sam9Session *Session) {
+  tcflush( Session->FileNumber, TCIFLUSH);
+  Session->SerialTail = Session->SerialHead;
+}
+
+// ----------------------------------------------------------------------------
+//  Resynchronize with RomBOOT: flush any partial command with a bare '#' and
+//  then check that a version query gets a complete reply.
+// ----------------------------------------------------------------------------
+
+bool Sam9Sync( Sam9Session *Session) {
+  fprintf( Session->FileHandle, "#\n");
+  fflush( Session->FileHandle);
+  GetResponse( Session, Session->Options.Trace, FRAME_DRAIN, PIPELINE_DRAIN_MS);
+  fprintf( Session->FileHandle, "V#\n");
+  fflush( Session->FileHandle);
+  if (Session->Options.Trace) {
+    printf( "V#");
+  }
+  GetResponse( Session, Session->Options.Trace, Session->FlagBinary ? FRAME_LINE : FRAME_PROMPT);
+  return Session->ResponseFramed && (Session->ResponseCount > 2);
+}
+
+// ----------------------------------------------------------------------------
+//  DBGU baud rate switching.  RomBOOT always talks on the DBGU at 115200, but
+//  the DBGU can run much faster.  The baud rate generator divisor is
+//  CD = MCK / (16 * rate), in the low 16 bits of DBGU_BRGR.
+// ----------------------------------------------------------------------------
+
+#define DBGU_BRGR       0xfffff220 // DBGU base 0xfffff200 + 0x20
+#define DBGU_SETTLE_MS  20         // let both ends change rate
+
+// ----------------------------------------------------------------------------
+//  Write a new divisor to DBGU_BRGR, move the host port to the matching rate
+//  and resynchronize.  The write is sent without trailing padding since any
+//  character after the '#' would arrive at the wrong rate.
+// ----------------------------------------------------------------------------
+
+static bool Sam9SwitchRate( Sam9Session *Session, bit32 Divisor, bit32 Rate) {
+  Sam9Issue( Session, 'W', DBGU_BRGR, 4, Divisor, 0, Session->Options.Trace);
+  Sam9Flush( Session);
+  tcdrain( Session->FileNumber);
+  usleep( DBGU_SETTLE_MS * 1000);
+  if (Sam9SetSerialMode( Session, Rate) == 0) {
+    return false;
+  }
+  usleep( DBGU_SETTLE_MS * 1000);
+  Sam9Discard( Session);
+  return Sam9Sync( Session);
+}
+
+// ----------------------------------------------------------------------------
+//  Switch the DBGU and host port to the turbo rate.  The master clock is
+//  taken from -m, or estimated from the current divisor.  If RomBOOT does
+//  not answer at the new rate the original divisor is written blind at the
+//  new rate and the link falls back to the original rate.
+// ----------------------------------------------------------------------------
+
+bool Sam9Turbo( Sam9Session *Session, bit32 Rate) {
+  bit32 Divisor, Mck = Session->Options.Mck;
+  if (Sam9Read( Session, DBGU_BRGR, 4, Divisor, Session->Options.Trace) == false) {
+    fprintf( stderr, "*** %sUnable to read DBGU_BRGR, staying at %d baud!\n", Session->Label, Session->Options.Baud);
+    return false;
+  }
+  Divisor &= 0xffff;
+  if (Mck == 0) {
+    Mck = Divisor * 16 * Session->Options.Baud;
+  }
+  bit32 NewDivisor = (Mck + (8 * Rate)) / (16 * Rate);
+  if (NewDivisor == 0) {
+    NewDivisor = 1;
+  }
+  if ((Divisor == 0) || (NewDivisor == Divisor)) {
+    return false;
+  }
+  bit32 NewRate = Mck / (16 * NewDivisor);
+  if (Sam9SwitchRate( Session, NewDivisor, NewRate)) {
+    Session->TurboDivisor = Divisor;
+    if (Session->Options.Quiet == false) {
+      printf( "%sSwitched DBGU to %d baud (MCK %d Hz%s, CD %d).\n", Session->Label, NewRate, Mck, Session->Options.Mck ? "" : " estimated", NewDivisor);
+    }
+    return true;
+  }
+  fprintf( stderr, "*** %sNo response at %d baud, falling back to %d baud!\n", Session->Label, NewRate, Session->Options.Baud);
+  if (Sam9SwitchRate( Session, Divisor, Session->Options.Baud) == false) {
+    fprintf( stderr, "*** %sNo response after falling back to %d baud!\n", Session->Label, Session->Options.Baud);
+  }
+  return false;
+}
+
+// ----------------------------------------------------------------------------
+//  Return the DBGU and host port to the original rate, so that anything
+//  started by 'G', the terminal and the next session all find it there.
+// ----------------------------------------------------------------------------
+
+void Sam9TurboOff( Sam9Session *Session) {
+  if (Session->TurboDivisor) {
+    if (Sam9SwitchRate( Session, Session->TurboDivisor, Session->Options.Baud) == false) {
+      fprintf( stderr, "*** %sNo response after returning to %d baud!\n", Session->Label, Session->Options.Baud);
+    }
+    Session->TurboDivisor = 0;
+} }
+
+// ----------------------------------------------------------------------------
+//  Calculate the XMODEM CRC16 (CCITT polynomial 0x1021, initial value zero)
+//  of a block of bytes.
+// ----------------------------------------------------------------------------
+
+unsigned short XmodemCrc16( const byte *Data, int Count) {
+  unsigned short Crc = 0;
+  while (Count--) {
+    Crc ^= (*Data++) << 8;
+    for (int i = 0; i < 8; i++) {
+      Crc = (Crc & 0x8000) ? (Crc << 1) ^ 0x1021 : (Crc << 1);
+  } }
+  return Crc;
+}
+
+// ----------------------------------------------------------------------------
+//  Build an XMODEM block of Size (128 or 1024) bytes: the header, the block
+//  number and its complement, the data and the CRC16 (or, for a receiver
+//  that started in checksum mode, the arithmetic sum).  Returns the length
+//  of the packet.
+// ----------------------------------------------------------------------------
+
+int XmodemBlock( bptr Packet, byte Block, const byte *Data, int Size, bool FlagCrc) {
+  int Length = 0;
+  Packet[Length++] = (Size == 1024) ? XMODEM_STX : XMODEM_SOH;
+  Packet[Length++] = Block;
+  Packet[Length++] = ~Block;
+  memcpy( Packet + Length, Data, Size);
+  Length += Size;
+  if (FlagCrc) {
+    unsigned short Crc = XmodemCrc16( Data, Size);
+    Packet[Length++] = Crc >> 8;
+    Packet[Length++] = Crc & 0xff;
+  } else {
+    byte Sum = 0;
+    for (int i = 0; i < Size; i++) {
+      Sum += Data[i];
+    }
+    Packet[Length++] = Sum;
+  }
+  return Length;
+}
+
+// ----------------------------------------------------------------------------
+//  Check a received XMODEM block, of which Length bytes arrived after the
+//  header (the block number, its complement, Size data bytes and the
+//  CRC16), and take it into Buffer at Offset if it is the one expected.
+//  Padding past Count is dropped.  Returns the answer for the sender: ACK
+//  for a good block or a repeat of the last one, NAK for a damaged block,
+//  CAN for one out of sequence.
+// ----------------------------------------------------------------------------
+
+int XmodemBlockTake( const byte *Packet, int Length, int Size, byte &Expect, bptr Buffer, bit32 Count, bit32 &Offset) {
+  if ((Length < Size + 4) || (Packet[0] != (byte) ~Packet[1]) || (XmodemCrc16( Packet+2, Size) != ((Packet[Size+2] << 8) | Packet[Size+3]))) {
+    return XMODEM_NAK;
+  }
+  if (Packet[0] == Expect) {
+    bit32 Used = (Count - Offset < (bit32) Size) ? Count - Offset : Size;
+    memcpy( Buffer + Offset, Packet+2, Used);
+    Offset += Used;
+    Expect++;
+  } else if (Packet[0] != (byte) (Expect - 1)) { // not a repeat of the last block
+    return XMODEM_CAN;
+  }
+  return XMODEM_ACK;
+}
+
+// ----------------------------------------------------------------------------
+//  Abort an XMODEM transfer in progress and resynchronize with RomBOOT.
+// ----------------------------------------------------------------------------
+
+static void XmodemCancel( Sam9Session *Session) {
+  static const byte Cancel[] = { XMODEM_CAN, XMODEM_CAN, XMODEM_CAN };
+  Sam9Send( Session, Cancel, sizeof( Cancel));
+  fprintf( Session->FileHandle, "#\n");
+  fflush( Session->FileHandle);
+  Sam9CommandDone( Session, Session->Options.Trace);
+}
+
+// ----------------------------------------------------------------------------
+//  Display transfer progress on the console (single port only, several
+//  ports would just overwrite each other's line).
+// ----------------------------------------------------------------------------
+
+static void ShowSendProgress( Sam9Session *Session, bit32 Length) {
+  if (Session->FlagProgress == false) {
+    return;
+  }
+  printf( "Uploading file '%s' (%d bytes) to memory at $%x...\r", Session->Job.FileName, Length, Session->Job.Address);
+  fflush( stdout);
+}
+
+static void ShowReceiveProgress( Sam9Session *Session, bit32 Length) {
+  if (Session->FlagProgress == false) {
+    return;
+  }
+  printf( "Downloading memory from $%x (%d bytes)...\r", Session->Job.Address, Length);
+  fflush( stdout);
+}
+
+// ----------------------------------------------------------------------------
+//  Send a buffer to target memory using the RomBOOT 'S' command.  The count
+//  must be a multiple of 128 bytes so that no memory beyond the end of the
+//  buffer is overwritten by block padding.  Blocks of BlockSize bytes (128
+//  or 1024) are sent while enough data remains, then 128-byte blocks.  Each
+//  block is retried on NAK or timeout.  The command is sent in lower case
+//  hex so that its echo in terminal mode holds no 'C' to be taken for the
+//  receiver starting.
+// ----------------------------------------------------------------------------
+
+static bool XmodemSend( Sam9Session *Session, bit32 Address, const byte *Buffer, bit32 Count, bit32 BlockSize) {
+  byte Packet[3 + 1024 + 2];
+  bool FlagCrc = true;
+  int c;
+  fprintf( Session->FileHandle, "S%x,%x#\n", Address, Count);
+  fflush( Session->FileHandle);
+  if (Session->Options.Trace) {
+    printf( "S%x,%x#", Address, Count);
+  }
+  do { // skip any echo or prompt, wait for the receiver to start
+    c = Sam9GetByte( Session, XMODEM_START_MS);
+  } while ((c >= 0) && (c != XMODEM_CRC) && (c != XMODEM_NAK));
+  if (c < 0) {
+    fprintf( stderr, "\n*** %sXMODEM transfer to $%x not started (target unresponsive)!\n", Session->Label, Address);
+    XmodemCancel( Session);
+    return false;
+  }
+  FlagCrc = (c == XMODEM_CRC);
+  bit32 Offset = 0;
+  byte Block = 1;
+  while (Offset < Count) {
+    int Size = ((BlockSize == 1024) && (Count - Offset >= 1024)) ? 1024 : 128;
+    int Length = XmodemBlock( Packet, Block, Buffer + Offset, Size, FlagCrc);
+    int Retry = 0;
+    for (c = -1; (c != XMODEM_ACK) && (Retry < XMODEM_RETRIES); Retry++) {
+      Sam9Send( Session, Packet, Length);
+      do {
+        c = Sam9GetByte( Session, XMODEM_BLOCK_MS);
+      } while ((c >= 0) && (c != XMODEM_ACK) && (c != XMODEM_NAK) && (c != XMODEM_CAN));
+      if (c == XMODEM_CAN) {
+        break;
+      }
+      if (Session->Options.Trace && (c != XMODEM_ACK)) {
+        printf( "[block %d %s]", Block, (c < 0) ? "timeout" : "nak");
+    } }
+    if (c != XMODEM_ACK) {
+      fprintf( stderr, "\n*** %sXMODEM transfer to $%x failed at offset %d (%s)!\n", Session->Label, Address, Offset, (c == XMODEM_CAN) ? "cancelled by target" : "too many retries");
+      XmodemCancel( Session);
+      return false;
+    }
+    Offset += Size;
+    Block++;
+    if ((Offset % 1024) == 0) {
+      ShowSendProgress( Session, Offset);
+  } }
+  for (int Retry = 0; Retry < XMODEM_RETRIES; Retry++) {
+    byte Eot = XMODEM_EOT;
+    Sam9Send( Session, &Eot, sizeof( Eot));
+    if ((c = Sam9GetByte( Session, XMODEM_BLOCK_MS)) == XMODEM_ACK) {
+      Sam9CommandDone( Session, Session->Options.Trace);
+      return true;
+  } }
+  fprintf( stderr, "\n*** %sXMODEM transfer to $%x not acknowledged at end!\n", Session->Label, Address);
+  XmodemCancel( Session);
+  return false;
+}
+
+// ----------------------------------------------------------------------------
+//  Discard incoming characters until the line has been quiet for a while,
+//  used to resynchronize after a damaged XMODEM block.
+// ----------------------------------------------------------------------------
+
+static void XmodemPurge( Sam9Session *Session) {
+  while (Sam9GetByte( Session, 100) >= 0) {
+  }
+}
+
+// ----------------------------------------------------------------------------
+//  Receive target memory into a buffer using the RomBOOT 'R' command.  The
+//  target may send 128 or 1024-byte blocks, each is checked by CRC16 and is
+//  acknowledged or rejected.  Any padding past the requested count is
+//  discarded.
+// ----------------------------------------------------------------------------
+
+static bool XmodemReceive( Sam9Session *Session, bit32 Address, bptr Buffer, bit32 Count) {
+  byte Packet[2 + 1024 + 2];
+  byte Expect = 1;
+  byte Reply = XMODEM_CRC;
+  bit32 Offset = 0;
+  int Retry = 0, c;
+  fprintf( Session->FileHandle, "R%X,%X#\n", Address, Count);
+  fflush( Session->FileHandle);
+  if (Session->Options.Trace) {
+    printf( "R%X,%X#", Address, Count);
+  }
+  while (Retry < XMODEM_RETRIES) {
+    Sam9Send( Session, &Reply, sizeof( Reply));
+    do { // skip any echo or prompt, wait for a block header
+      c = Sam9GetByte( Session, (Offset || (Reply != XMODEM_CRC)) ? XMODEM_BLOCK_MS : XMODEM_BYTE_MS);
+    } while ((c >= 0) && (c != XMODEM_SOH) && (c != XMODEM_STX) && (c != XMODEM_EOT) && (c != XMODEM_CAN));
+    if (c == XMODEM_EOT) {
+      byte Ack = XMODEM_ACK;
+      Sam9Send( Session, &Ack, sizeof( Ack));
+      Sam9CommandDone( Session, Session->Options.Trace);
+      if (Offset >= Count) {
+        return true;
+      }
+      fprintf( stderr, "\n*** %sXMODEM transfer from $%x ended early at offset %d!\n", Session->Label, Address, Offset);
+      return false;
+    }
+    if (c == XMODEM_CAN) {
+      fprintf( stderr, "\n*** %sXMODEM transfer from $%x cancelled by target at offset %d!\n", Session->Label, Address, Offset);
+      return false;
+    }
+    if (c < 0) {
+      Retry++;
+      continue;
+    }
+    int Size = (c == XMODEM_STX) ? 1024 : 128;
+    int Length = Sam9GetBlock( Session, Packet, Size + 4, XMODEM_BYTE_MS);
+    bit32 Before = Offset;
+    int Answer = XmodemBlockTake( Packet, Length, Size, Expect, Buffer, Count, Offset);
+    if (Answer == XMODEM_NAK) {
+      if (Session->Options.Trace) {
+        printf( "[block %d %s]", Expect, (Length < Size + 4) ? "timeout" : "bad");
+      }
+      XmodemPurge( Session);
+      Reply = XMODEM_NAK;
+      Retry++;
+      continue;
+    }
+    if (Answer == XMODEM_CAN) {
+      fprintf( stderr, "\n*** %sXMODEM transfer from $%x out of sequence at offset %d!\n", Session->Label, Address, Offset);
+      XmodemCancel( Session);
+      return false;
+    }
+    if ((Offset != Before) && ((Offset % 1024) == 0)) {
+      ShowReceiveProgress( Session, Offset);
+    }
+    Reply = XMODEM_ACK;
+    Retry = 0;
+  }
+  fprintf( stderr, "\n*** %sXMODEM transfer from $%x failed at offset %d (too many retries)!\n", Session->Label, Address, Offset);
+  XmodemCancel( Session);
+  return false;
+}
+
+// ----------------------------------------------------------------------------
+//  Read target memory into a buffer.  Larger blocks are downloaded via
+//  XMODEM, smaller ones (or if XMODEM fails) one word (or trailing byte) at
+//  a time.
+// ----------------------------------------------------------------------------
+
+bool Sam9ReadMemory( Sam9Session *Session, bit32 Address, bptr Buffer, bit32 Count) {
+  if (Session->Options.Xmodem && (Count >= XMODEM_MINIMUM)) {
+    if (XmodemReceive( Session, Address, Buffer, Count)) {
+      return true;
+    }
+    printf( "%sXMODEM download failed, falling back to word mode.\n", Session->Label);
+  }
+  if (Sam9Pipeline( Session, false, Address, Buffer, Count, ShowReceiveProgress, 0)) {
+    return true;
+  }
+  fprintf( stderr, "*** %sFailed to download memory from $%x (%d bytes expected, target unresponsive)!\n", Session->Label, Address, Count);
+  return false;
+}
+
+// ----------------------------------------------------------------------------
+//  Load a sam9 memory image into a dynamically-allocated buffer.
+// ----------------------------------------------------------------------------
+
+bool LoadMemory( Sam9Session *Session, bit32 StartAddress, bit32 Count) {
+  if (Session->MemoryBuffer = (bptr) calloc( Count, 1)) {
+    if (Sam9ReadMemory( Session, StartAddress, Session->MemoryBuffer, Count)) {
+      Session->MemoryCount = Count;
+      return true;
+    }
+  } else {
+    fprintf( stderr, "*** %sFailed to download memory from $%x (%d bytes, calloc error)!\n", Session->Label, StartAddress, Count);
+  }
+  return false;
+}
+
+// ----------------------------------------------------------------------------
+//  Write a buffer to target memory.  Whole 128-byte blocks go via XMODEM,
+//  any trailing partial block (or everything, if XMODEM fails) is sent one
+//  word (or trailing byte) at a time using pipelined RomBOOT 'W' and 'O'
+//  commands, the slow but dependable fallback.
+// ----------------------------------------------------------------------------
+
+bool Sam9WriteMemory( Sam9Session *Session, bit32 Address, const byte *Buffer, bit32 Count) {
+  bit32 Length = 0;
+  if (Session->Options.Xmodem && (Count >= 128)) {
+    if (XmodemSend( Session, Address, Buffer, Count & ~127, Session->Options.Xmodem)) {
+      Length = Count & ~127;
+    } else {
+      printf( "%sXMODEM upload failed, falling back to word mode.\n", Session->Label);
+  } }
+  return Sam9Pipeline( Session, true, Address + Length, (bptr) Buffer + Length, Count - Length, ShowSendProgress, Length);
+}
+
+// ----------------------------------------------------------------------------
+//  Open the port for a session, set the serial rate and get RomBOOT's
+//  attention, then switch to binary mode and the turbo rate as requested.
+// ----------------------------------------------------------------------------
+
+void Sam9Handshake( Sam9Session *Session, bool Chatty) {
+  fprintf( Session->FileHandle, "#\n");
+  if (Chatty) {
+    printf( "#");
+  }
+  GetResponse( Session, Chatty);
+  if (Chatty) {
+    fprintf( Session->FileHandle, "V#\n");
+    printf( "V#");
+    GetResponse( Session);
+  }
+  if (Session->Options.Echo == false) {
+    Sam9SetBinaryMode( Session, true, Chatty);
+  }
+  if (Session->Options.Turbo) {
+    Sam9Turbo( Session, Session->Options.Turbo);
+} }
+
+// ----------------------------------------------------------------------------
+//  The command stream is a stdio stream whose output goes through the
+//  session transport, so formatted commands and raw XMODEM blocks take the
+//  same path.  Closing it releases the transport and the port.
+// ----------------------------------------------------------------------------
+
+static ssize_t Sam9CookieWrite( void *Cookie, const char *Data, size_t Count) {
+  return Sam9Send( (Sam9Session *) Cookie, Data, Count) ? Count : -1;
+}
+
+static int Sam9CookieClose( void *Cookie) {
+  Sam9Session *Session = (Sam9Session *) Cookie;
+  Sam9UringClose( Session);
+  return close( Session->FileNumber);
+}
+
+bool Sam9Open( Sam9Session *Session, bool Chatty) {
+  static const cookie_io_functions_t Functions = { NULL, Sam9CookieWrite, NULL, Sam9CookieClose };
+  if ((Session->FileNumber = open( Session->Port, O_RDWR | O_CREAT | O_APPEND, 0666)) < 0) {
+    fprintf( stderr, "*** Unable to open device '%s' for i/o!\n", Session->Port);
+    return false;
+  }
+  if (Session->Options.Uring && (Sam9UringOpen( Session) == false)) {
+    close( Session->FileNumber);
+    return false;
+  }
+  if ((Session->FileHandle = fopencookie( Session, "a+b", Functions)) == NULL) {
+    fprintf( stderr, "*** Unable to open device '%s' for i/o!\n", Session->Port);
+    Sam9UringClose( Session);
+    close( Session->FileNumber);
+    return false;
+  }
+  if ((Session->Uring != NULL) || isatty( Session->FileNumber)) { // a line at a time, as fopen() does on a tty
+    setvbuf( Session->FileHandle, NULL, _IOLBF, BUFSIZ);
+  }
+  bit32 ActualBaud = Sam9SetSerialMode( Session, Session->Options.Baud);
+  if (ActualBaud == 0) {
+    fprintf( stderr, "*** Unable to set '%s' to %d baud!\n", Session->Port, Session->Options.Baud);
+  } else if ((ActualBaud * 50 < Session->Options.Baud * 49) || (ActualBaud * 50 > Session->Options.Baud * 51)) {
+    fprintf( stderr, "*** Port '%s' set to %d baud, %d requested!\n", Session->Port, ActualBaud, Session->Options.Baud);
+  } else if (Chatty && (Session->Options.Baud != 115200)) {
+    printf( "Port '%s' set to %d baud.\n", Session->Port, ActualBaud);
+  }
+  Sam9Handshake( Session, Chatty);
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+//  Format memory as a classic hex and ascii dump, 16 bytes per line.
+// ----------------------------------------------------------------------------
+
+void DumpMemory( fptr Output, bit32 Address, const byte *Buffer, bit32 Count) {
+  bit32 Offset = 0;
+  char Template[66];
+  while (Offset < Count) {
+    for (int i = 0; i < sizeof( Template); i++) {
+      Template[i] = ' ';
+    }
+    Template[sizeof(Template)-1] = 0;
+    for (int i = 0, j = 0, k = 49; (i < 16) && (Offset < Count); i++) {
+      byte Value = Buffer[Offset++];
+      char Temp[16];
+      sprintf( Temp, "%2.2x", Value);
+      Template[j++] = Temp[0];
+      Template[j++] = Temp[1]; j++;
+      Template[k++] = ((Value > 0x1f) && (Value < 0x7f)) ? Value : '.';
+    }
+    fprintf( Output, "$%6.6x  %s\n", Address, Template);
+    Address += 16;
+} }
+
+// ----------------------------------------------------------------------------
+//  Sam9Session methods, the interface for callers that embed the library.
+//  They are thin wrappers around the functions above and report failure
+//  by return value, with the details on stderr like the rest of the tool.
+// ----------------------------------------------------------------------------
+
+bool Sam9Session::Open( ccptr PortName, const Sam9Options &SessionOptions) {
+  Port = PortName;
+  Label = "";
+  Options = SessionOptions;
+  if (Sam9Open( this, false) == false) {
+    return false;
+  }
+  if (Sam9Sync( this)) {
+    return true;
+  }
+  fprintf( stderr, "*** Target on '%s' not responding!\n", Port);
+  Close();
+  return false;
+}
+
+void Sam9Session::Close( void) {
+  if (FileHandle) {
+    Sam9TurboOff( this);
+    if (FlagBinary) {
+      Sam9SetBinaryMode( this, false, false);
+    }
+    fclose( FileHandle);
+    FileHandle = NULL;
+  }
+  free( MemoryBuffer);
+  MemoryBuffer = NULL;
+  MemoryCount = 0;
+}
+
+bool Sam9Session::Read( bit32 Address, std::span<byte> Data) {
+  return Sam9ReadMemory( this, Address, Data.data(), Data.size());
+}
+
+bool Sam9Session::Write( bit32 Address, std::span<const byte> Data) {
+  return Sam9WriteMemory( this, Address, Data.data(), Data.size());
+}
+
+bool Sam9Session::Go( bit32 Address) {
+  Sam9TurboOff( this);
+  fprintf( FileHandle, "G%X#\n", Address);
+  fflush( FileHandle);
+  GetResponse( this, false, FRAME_DRAIN, RESPONSE_IDLE_MS);
+  FlagBinary = false; // RomBOOT is gone until the board is reset
+  return true;
+}
+
+bool Sam9Session::PartId( bit32 &Id) {
+  return Sam9Read( this, 0xfffff240, 4, Id, false);
+}
+
+// ----------------------------------------------------------------------------
+//  End
+// ----------------------------------------------------------------------------
@@ -0,0 +1,235 @@
+// ----------------------------------------------------------------------------
+// sam9lib - Atmel SAM9 SAM-BA RomBOOT session library.
+// ----------------------------------------------------------------------------
+//
+//   Copyright 2011 Michael E. Nagy
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+// ----------------------------------------------------------------------------
+//
+// A Sam9Session owns one serial port and the RomBOOT monitor behind it.  A
+// test executive can embed it directly (link with libsam9boot.a, C++20):
+//
+//     Sam9Session Session = {};
+//     Sam9Options Options;
+//     if (Session.Open( "/dev/ttyUSB0", Options)) {
+//       Session.Write( 0x300000, Image);   // std::span of bytes
+//       Session.Read( 0x300000, Check);
+//       Session.Go( 0x300000);
+//       Session.Close();
+//     }
+//
+// The free functions below are what the sam9boot front end is built on.
+//
+// ----------------------------------------------------------------------------
+
+#ifndef SAM9LIB_H
+#define SAM9LIB_H
+
+#include <stdio.h>
+#include <span>
+
+// ----------------------------------------------------------------------------
+//  Local types for conciseness.
+// ----------------------------------------------------------------------------
+
+typedef unsigned int  bit32; // unsigned 32-bit
+typedef unsigned char byte ; // unsigned  8-bit
+
+typedef FILE       *  fptr;
+typedef       char *  cptr;
+typedef const char * ccptr;
+typedef       byte *  bptr;
+
+// ----------------------------------------------------------------------------
+//  Link settings, the library's share of the command-line parameters.
+// ----------------------------------------------------------------------------
+
+struct Sam9Options {
+  bit32  Baud   = 115200;             // -b, host and DBGU rate
+  bit32  Turbo  = 0;                  // -u, faster DBGU rate or zero
+  bit32  Mck    = 0;                  // -m, master clock or zero to estimate
+  bit32  Xmodem = 128;                // -x, block size or zero for words
+  bit32  Window = 8;                  // -w, word commands in flight
+  bool   Echo   = false;              // -e, stay in terminal mode
+  bool   Trace  = false;              // -t, show the conversation
+  bool   Quiet  = false;              // -q, no non-essential messages
+  bool   Uring  = false;              // --uring, io_uring serial transport
+  bit32  Applet = 0x305000;           // --applet, spare SRAM for target routines
+};
+
+// ----------------------------------------------------------------------------
+//  One RomBOOT session on one serial port.  Everything that belongs to a
+//  port lives here so that several ports can be driven at once, each from
+//  its own thread, sharing only the read-only parameters and file image.
+// ----------------------------------------------------------------------------
+
+#define SERIAL_BUFFER 4096 // must be a power of two
+
+struct Sam9Uring;
+
+struct Sam9Segment {
+  bit32  Address;                     // target address
+  const byte *Data;                   // file image of the segment
+  bit32  Bytes;                       // bytes of Data
+  bit32  Zero;                        // bytes zero-filled after Data (ELF .bss)
+};
+
+struct Sam9Job {
+  ccptr  FileName;                    // image to send or verify, -r output
+  const byte *Image;                  // file image, shared and read-only
+  bit32  Bytes;                       // image size or -n
+  bit32  Address;                     // -a
+  bit32  AddrJump;                    // -j
+  bool   FlagJump;
+  bool   FlagSend;
+  bool   FlagVerify;
+  bool   FlagDelta;                   // --delta, send only changed blocks
+  bool   FlagCrc;                     // --crc, verify with the target CRC32
+  bool   FlagSparse;                  // --sparse, fill 0x00/0xff runs on the target
+  bool   FlagCompress;                // --compress, stage LZ4 and expand on the target
+  bool   FlagResume;                  // --resume, carry on an interrupted -s or -r
+  bit32  Stage;                       // --stage, or zero for just past the image
+  const Sam9Segment *Segments;        // several regions (ELF), or NULL for Image
+  int    SegmentCount;
+};
+
+struct Sam9Session {
+  Sam9Options Options;                // link settings
+  Sam9Job Job;                        // what to do on this port
+  ccptr  Port;                        // device name
+  ccptr  Label;                       // message prefix, empty for one port
+  fptr   FileHandle;                  // formatted commands
+  int    FileNumber;                  // raw i/o
+  Sam9Uring *Uring;                   // io_uring transport, if in use
+  bit32  Syscalls;                    // serial i/o system calls made
+  byte   SerialBuffer[SERIAL_BUFFER]; // buffered serial input
+  bit32  SerialHead, SerialTail;      // free-running, masked on use
+  bit32  ResponseCount;               // characters in the last response
+  bool   ResponseFramed;              // last response was complete
+  bool   FlagBinary;                  // RomBOOT in non-interactive mode
+  bool   FlagProgress;                // show progress messages
+  bit32  TurboDivisor;                // original DBGU divisor while switched
+  bptr   MemoryBuffer;                // memory downloaded from the target
+  bit32  MemoryCount;
+  bool   Success;                     // outcome for the multi-port summary
+  bit32  Moved;                       // bytes moved over the link
+  double Seconds;                     // time from open to close
+
+  bool Open( ccptr PortName, const Sam9Options &SessionOptions);
+  void Close( void);
+  bool Read( bit32 Address, std::span<byte> Data);
+  bool Write( bit32 Address, std::span<const byte> Data);
+  bool Go( bit32 Address);
+  bool PartId( bit32 &Id);
+};
+
+// ----------------------------------------------------------------------------
+//  Response framing for GetResponse().  A positive frame value is the exact
+//  number of binary bytes expected (a non-interactive mode read).
+// ----------------------------------------------------------------------------
+
+#define FRAME_PROMPT     -1  // reply ends with the '>' prompt
+#define FRAME_LINE       -2  // reply ends with a CR/LF pair
+#define FRAME_DRAIN       0  // no reply expected, collect until line is idle
+
+#define RESPONSE_MS      500 // deadline for a framed reply
+#define RESPONSE_IDLE_MS 4   // idle time that ends a drain
+
+#define SAM9_COMMAND_MAX 48  // longest encoded command, padding included
+
+#define PIPELINE_RETRIES  3  // consecutive failures of one command
+#define PIPELINE_DRAIN_MS 50 // idle time that ends a drain after a failure
+
+// ----------------------------------------------------------------------------
+//  Pipelined word access state, shared by the blocking and the coroutine
+//  sessions.  Commands are numbered from zero, the words first and then any
+//  trailing bytes, see PipelineStart() and friends in sam9lib.c.
+// ----------------------------------------------------------------------------
+
+struct Sam9Pipe {
+  bool   Write;
+  bool   Checkpoint;                  // silent writes, read the last one back
+  bit32  Address;
+  bptr   Buffer;
+  bit32  Words, Total;                // word commands, all commands
+  bit32  Issued, Done;                // commands sent, commands confirmed
+  bit32  Window, Good;                // commands in flight, good replies since it grew
+  int    Retry;                       // consecutive failures
+};
+
+// ----------------------------------------------------------------------------
+//  XMODEM protocol constants.  RomBOOT implements XMODEM for its 'S' (send
+//  file to target) and 'R' (receive file from target) commands.
+// ----------------------------------------------------------------------------
+
+#define XMODEM_SOH      0x01 // 128-byte block header
+#define XMODEM_STX      0x02 // 1024-byte block header
+#define XMODEM_EOT      0x04 // end of transmission
+#define XMODEM_ACK      0x06 // block accepted
+#define XMODEM_NAK      0x15 // block rejected (or checksum mode start)
+#define XMODEM_CAN      0x18 // transfer cancelled
+#define XMODEM_CRC      'C'  // crc mode start
+
+#define XMODEM_RETRIES  10   // attempts per block before giving up
+#define XMODEM_START_MS 3000 // wait for receiver start character
+#define XMODEM_BLOCK_MS 2000 // wait for block acknowledgement
+#define XMODEM_BYTE_MS  1000 // wait for each byte within a received block
+#define XMODEM_MINIMUM  256  // smallest download worth the XMODEM overhead
+
+// ----------------------------------------------------------------------------
+//  Library functions, see sam9lib.c for the details of each.
+// ----------------------------------------------------------------------------
+
+bool   FileWriteBlock( int FileNumber, const void *Data, int Count);
+double TimeNow( void);
+
+bool   Sam9Send( Sam9Session *Session, const void *Data, int Count);
+void   Sam9Flush( Sam9Session *Session);
+int    Sam9Buffered( Sam9Session *Session);
+int    Sam9ReadAvailable( Sam9Session *Session);
+bit32  Sam9SetSerialMode( Sam9Session *Session, bit32 Rate);
+int    Sam9Encode( char *Text, char Command, bit32 Address, int Size, bit32 Value, int Pad);
+int    PipelinePad( Sam9Session *Session, bool Write, int Size, bit32 Window);
+void   PipelineStart( Sam9Session *Session, Sam9Pipe &Pipe, bool Write, bit32 Address, bptr Buffer, bit32 Count);
+bit32  PipelineOffset( const Sam9Pipe &Pipe, bit32 Index);
+int    PipelineSize( const Sam9Pipe &Pipe, bit32 Index);
+bool   PipelineRoom( const Sam9Pipe &Pipe);
+int    PipelineIssue( Sam9Session *Session, Sam9Pipe &Pipe, char *Text);
+int    PipelineCheckpoint( Sam9Session *Session, Sam9Pipe &Pipe, char *Text);
+bool   PipelineReply( Sam9Session *Session, Sam9Pipe &Pipe, bit32 Value);
+bool   PipelineFailed( Sam9Pipe &Pipe);
+unsigned short XmodemCrc16( const byte *Data, int Count);
+int    XmodemBlock( bptr Packet, byte Block, const byte *Data, int Size, bool FlagCrc);
+int    XmodemBlockTake( const byte *Packet, int Length, int Size, byte &Expect, bptr Buffer, bit32 Count, bit32 &Offset);
+bit32  GetResponse( Sam9Session *Session, bool FlagTrace = true, int Frame = FRAME_PROMPT, int Milliseconds = RESPONSE_MS);
+void   Sam9SetBinaryMode( Sam9Session *Session, bool Binary, bool FlagTrace);
+bool   Sam9Read( Sam9Session *Session, bit32 Address, int Size, bit32 &Value, bool FlagTrace);
+void   Sam9Write( Sam9Session *Session, bit32 Address, int Size, bit32 Value, bool FlagTrace);
+void   Sam9Discard( Sam9Session *Session);
+bool   Sam9Sync( Sam9Session *Session);
+bool   Sam9Turbo( Sam9Session *Session, bit32 Rate);
+void   Sam9TurboOff( Sam9Session *Session);
+bool   Sam9ReadMemory( Sam9Session *Session, bit32 Address, bptr Buffer, bit32 Count);
+bool   Sam9WriteMemory( Sam9Session *Session, bit32 Address, const byte *Buffer, bit32 Count);
+bool   LoadMemory( Sam9Session *Session, bit32 StartAddress, bit32 Count);
+void   Sam9Handshake( Sam9Session *Session, bool Chatty);
+bool   Sam9Open( Sam9Session *Session, bool Chatty);
+void   DumpMemory( fptr Output, bit32 Address, const byte *Buffer, bit32 Count);
+
+#endif
+
+// ----------------------------------------------------------------------------
+//  End
+// ----------------------------------------------------------------------------
@@ -0,0 +1,390 @@
+// ----------------------------------------------------------------------------
+// sam9uring - io_uring serial transport for RomBOOT sessions.
+// ----------------------------------------------------------------------------
+//
+//   Copyright 2011 Michael E. Nagy
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+// ----------------------------------------------------------------------------
+//
+// The ring is driven with the raw system calls, there is no dependency on
+// liburing.  Each session has its own small ring, so sessions on different
+// threads (several ports, the daemon workers) never share one.  The serial
+// input buffer and an output buffer are registered with the ring, reads
+// and writes use them as fixed buffers where the kernel allows it.
+//
+// ----------------------------------------------------------------------------
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "sam9uring.h"
+
+#ifdef __linux__
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 8     // submission queue depth
+#define URING_OUTPUT  16384 // registered output buffer
+
+#define URING_READ    1     // completion tags
+#define URING_WRITE   2
+#define URING_CANCEL  3
+
+// ----------------------------------------------------------------------------
+//  Per-session ring state.  At most one read and one write are outstanding.
+//  A write that has been queued but not yet submitted (Output) keeps
+//  growing as more commands are written, so everything written between
+//  two waits goes to the kernel as one request.
+// ----------------------------------------------------------------------------
+
+struct Sam9Uring {
+  int    Ring;                        // io_uring file descriptor
+  bool   Fixed;                       // buffers registered
+  bit32 *SqHead, *SqTail, *SqMask, *SqArray;
+  bit32 *CqHead, *CqTail, *CqMask;
+  struct io_uring_sqe *Sqes;
+  struct io_uring_cqe *Cqes;
+  void  *SqMap, *CqMap;
+  size_t SqSize, CqSize, SqesSize;
+  bit32  Queued;                      // requests not yet submitted
+  bool   Reading;                     // read queued or in flight
+  bool   Writing;                     // write submitted, not complete
+  bool   Failed;                      // read or write error, end of file
+  struct io_uring_sqe *Output;        // queued write that may still grow
+  bit32  OutputStart, OutputCount;    // its part of OutputBuffer
+  byte   OutputBuffer[URING_OUTPUT];
+};
+
+// ----------------------------------------------------------------------------
+//  Submit queued requests and optionally wait for at least one completion,
+//  no longer than the specified number of milliseconds.
+// ----------------------------------------------------------------------------
+
+static void UringEnter( Sam9Session *Session, bool Wait, int Milliseconds) {
+  Sam9Uring *Uring = Session->Uring;
+  struct __kernel_timespec Timeout = { Milliseconds / 1000, (Milliseconds % 1000) * 1000000L };
+  struct io_uring_getevents_arg Argument = {};
+  Argument.ts = (unsigned long long) &Timeout;
+  Session->Syscalls++;
+  int r = syscall( __NR_io_uring_enter, Uring->Ring, Uring->Queued, Wait ? 1 : 0, Wait ? (IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG) : 0, Wait ? &Argument : NULL, sizeof( Argument));
+  if (r > 0) {
+    Uring->Queued -= r;
+    if (Uring->Output && (Uring->Queued == 0)) {
+      Uring->Output = NULL;
+      Uring->Writing = true;
+} } }
+
+// ----------------------------------------------------------------------------
+//  Get a cleared submission queue entry, submitting what is queued first if
+//  the queue is full.
+// ----------------------------------------------------------------------------
+
+static struct io_uring_sqe *UringEntry( Sam9Session *Session) {
+  Sam9Uring *Uring = Session->Uring;
+  bit32 Tail = *Uring->SqTail;
+  if (Tail - __atomic_load_n( Uring->SqHead, __ATOMIC_ACQUIRE) > *Uring->SqMask) {
+    UringEnter( Session, false, 0);
+    if (Tail - __atomic_load_n( Uring->SqHead, __ATOMIC_ACQUIRE) > *Uring->SqMask) {
+      return NULL;
+  } }
+  bit32 Index = Tail & *Uring->SqMask;
+  struct io_uring_sqe *Entry = &Uring->Sqes[Index];
+  memset( Entry, 0, sizeof( *Entry));
+  Uring->SqArray[Index] = Index;
+  __atomic_store_n( Uring->SqTail, Tail + 1, __ATOMIC_RELEASE);
+  Uring->Queued++;
+  return Entry;
+}
+
+// ----------------------------------------------------------------------------
+//  Queue a write of the pending part of the output buffer.
+// ----------------------------------------------------------------------------
+
+static bool UringQueueOutput( Sam9Session *Session) {
+  Sam9Uring *Uring = Session->Uring;
+  struct io_uring_sqe *Entry = UringEntry( Session);
+  if (Entry == NULL) {
+    return false;
+  }
+  Entry->opcode = Uring->Fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+  Entry->fd = Session->FileNumber;
+  Entry->addr = (unsigned long long) (Uring->OutputBuffer + Uring->OutputStart);
+  Entry->len = Uring->OutputCount;
+  Entry->off = (unsigned long long) -1;
+  Entry->buf_index = 1;
+  Entry->user_data = URING_WRITE;
+  Uring->Output = Entry;
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+//  Queue a read into the contiguous free part of the serial input buffer.
+// ----------------------------------------------------------------------------
+
+static bool UringQueueRead( Sam9Session *Session) {
+  Sam9Uring *Uring = Session->Uring;
+  int Space = SERIAL_BUFFER - Sam9Buffered( Session);
+  bit32 Head = Session->SerialHead & (SERIAL_BUFFER - 1);
+  if (Space > (int) (SERIAL_BUFFER - Head)) {
+    Space = SERIAL_BUFFER - Head;
+  }
+  struct io_uring_sqe *Entry;
+  if ((Space <= 0) || ((Entry = UringEntry( Session)) == NULL)) {
+    return false;
+  }
+  Entry->opcode = Uring->Fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  Entry->fd = Session->FileNumber;
+  Entry->addr = (unsigned long long) (Session->SerialBuffer + Head);
+  Entry->len = Space;
+  Entry->off = (unsigned long long) -1;
+  Entry->buf_index = 0;
+  Entry->user_data = URING_READ;
+  Uring->Reading = true;
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+//  Collect completions, which needs no system call.  Read data is already
+//  in place in the serial buffer, a short write has its remainder queued.
+// ----------------------------------------------------------------------------
+
+static void UringReap( Sam9Session *Session) {
+  Sam9Uring *Uring = Session->Uring;
+  bit32 Head = *Uring->CqHead;
+  bit32 Tail = __atomic_load_n( Uring->CqTail, __ATOMIC_ACQUIRE);
+  for (; Head != Tail; Head++) {
+    struct io_uring_cqe *Completion = &Uring->Cqes[Head & *Uring->CqMask];
+    int Result = Completion->res;
+    switch (Completion->user_data) {
+      case URING_READ:
+        Uring->Reading = false;
+        if (Result > 0) {
+          Session->SerialHead += Result;
+        } else if ((Result != -EAGAIN) && (Result != -EINTR) && (Result != -ECANCELED)) {
+          Uring->Failed = true;
+        }
+        break;
+      case URING_WRITE:
+        Uring->Writing = false;
+        if (Result < 0) {
+          Uring->Failed = true;
+          Uring->OutputCount = 0;
+        } else if ((bit32) Result < Uring->OutputCount) {
+          Uring->OutputStart += Result;
+          Uring->OutputCount -= Result;
+          UringQueueOutput( Session);
+        } else {
+          Uring->OutputStart = Uring->OutputCount = 0;
+        }
+        break;
+  } }
+  __atomic_store_n( Uring->CqHead, Head, __ATOMIC_RELEASE);
+}
+
+// ----------------------------------------------------------------------------
+//  Set up the ring for a session whose port is already open.
+// ----------------------------------------------------------------------------
+
+bool Sam9UringOpen( Sam9Session *Session) {
+  Sam9Uring *Uring = (Sam9Uring *) calloc( 1, sizeof( Sam9Uring));
+  struct io_uring_params Params = {};
+  if (Uring == NULL) {
+    return false;
+  }
+  if ((Uring->Ring = syscall( __NR_io_uring_setup, URING_ENTRIES, &Params)) < 0) {
+    fprintf( stderr, "*** %sio_uring not available (%s)!\n", Session->Label, strerror( errno));
+    free( Uring);
+    return false;
+  }
+  if ((Params.features & IORING_FEAT_EXT_ARG) == 0) {
+    fprintf( stderr, "*** %sio_uring too old for timed waits (Linux 5.11 or later needed)!\n", Session->Label);
+    close( Uring->Ring);
+    free( Uring);
+    return false;
+  }
+  Uring->SqSize = Params.sq_off.array + Params.sq_entries * sizeof( bit32);
+  Uring->CqSize = Params.cq_off.cqes + Params.cq_entries * sizeof( struct io_uring_cqe);
+  Uring->SqesSize = Params.sq_entries * sizeof( struct io_uring_sqe);
+  Uring->SqMap = mmap( NULL, Uring->SqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Uring->Ring, IORING_OFF_SQ_RING);
+  Uring->CqMap = mmap( NULL, Uring->CqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Uring->Ring, IORING_OFF_CQ_RING);
+  Uring->Sqes = (struct io_uring_sqe *) mmap( NULL, Uring->SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Uring->Ring, IORING_OFF_SQES);
+  if ((Uring->SqMap == MAP_FAILED) || (Uring->CqMap == MAP_FAILED) || (Uring->Sqes == MAP_FAILED)) {
+    fprintf( stderr, "*** %sio_uring rings could not be mapped!\n", Session->Label);
+    Session->Uring = Uring;
+    Sam9UringClose( Session);
+    return false;
+  }
+  byte *Sq = (byte *) Uring->SqMap, *Cq = (byte *) Uring->CqMap;
+  Uring->SqHead  = (bit32 *) (Sq + Params.sq_off.head);
+  Uring->SqTail  = (bit32 *) (Sq + Params.sq_off.tail);
+  Uring->SqMask  = (bit32 *) (Sq + Params.sq_off.ring_mask);
+  Uring->SqArray = (bit32 *) (Sq + Params.sq_off.array);
+  Uring->CqHead  = (bit32 *) (Cq + Params.cq_off.head);
+  Uring->CqTail  = (bit32 *) (Cq + Params.cq_off.tail);
+  Uring->CqMask  = (bit32 *) (Cq + Params.cq_off.ring_mask);
+  Uring->Cqes    = (struct io_uring_cqe *) (Cq + Params.cq_off.cqes);
+  struct iovec Buffers[2] = {
+    { Session->SerialBuffer, SERIAL_BUFFER },
+    { Uring->OutputBuffer, URING_OUTPUT },
+  };
+  Uring->Fixed = syscall( __NR_io_uring_register, Uring->Ring, IORING_REGISTER_BUFFERS, Buffers, 2) == 0;
+  Session->Uring = Uring;
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+//  Finish any output, cancel the outstanding read and release the ring.
+//  The read must be gone before the session (and so its serial buffer)
+//  can be reused.
+// ----------------------------------------------------------------------------
+
+void Sam9UringClose( Sam9Session *Session) {
+  Sam9Uring *Uring = Session->Uring;
+  if (Uring == NULL) {
+    return;
+  }
+  if (Uring->Sqes && (Uring->Sqes != MAP_FAILED)) {
+    Sam9UringFlush( Session);
+    if (Uring->Reading) {
+      if (struct io_uring_sqe *Entry = UringEntry( Session)) {
+        Entry->opcode = IORING_OP_ASYNC_CANCEL;
+        Entry->addr = URING_READ;
+        Entry->user_data = URING_CANCEL;
+      }
+      double Deadline = TimeNow() + (RESPONSE_MS / 1000.0);
+      while (Uring->Reading && (TimeNow() < Deadline)) {
+        UringEnter( Session, true, RESPONSE_MS);
+        UringReap( Session);
+    } }
+    munmap( Uring->Sqes, Uring->SqesSize);
+  }
+  if (Uring->SqMap && (Uring->SqMap != MAP_FAILED)) {
+    munmap( Uring->SqMap, Uring->SqSize);
+  }
+  if (Uring->CqMap && (Uring->CqMap != MAP_FAILED)) {
+    munmap( Uring->CqMap, Uring->CqSize);
+  }
+  close( Uring->Ring);
+  free( Uring);
+  Session->Uring = NULL;
+}
+
+// ----------------------------------------------------------------------------
+//  Add input to the serial buffer, waiting up to the specified number of
+//  milliseconds for it.  Queued output is submitted with the wait, so a
+//  command and the wait for its reply take a single system call.  Returns
+//  the number of characters added.
+// ----------------------------------------------------------------------------
+
+int Sam9UringFill( Sam9Session *Session, int Milliseconds) {
+  Sam9Uring *Uring = Session->Uring;
+  bit32 Before = Session->SerialHead;
+  double Deadline = TimeNow() + (Milliseconds / 1000.0);
+  for (;;) {
+    UringReap( Session);
+    if ((Session->SerialHead != Before) || Uring->Failed) {
+      break;
+    }
+    if ((Uring->Reading == false) && (UringQueueRead( Session) == false)) {
+      break;
+    }
+    int Wait = (int) ((Deadline - TimeNow()) * 1000.0 + 0.5);
+    if (Wait <= 0) {
+      if (Uring->Queued) {
+        UringEnter( Session, false, 0);
+        UringReap( Session);
+      }
+      break;
+    }
+    UringEnter( Session, true, Wait);
+  }
+  return Session->SerialHead - Before;
+}
+
+// ----------------------------------------------------------------------------
+//  Add output to the queued write, starting a new one when the last has
+//  completed.  Nothing reaches the kernel until the next wait, a full
+//  output buffer or a flush.
+// ----------------------------------------------------------------------------
+
+bool Sam9UringWrite( Sam9Session *Session, const void *Data, int Count) {
+  Sam9Uring *Uring = Session->Uring;
+  const byte *p = (const byte *) Data;
+  double Deadline = TimeNow() + (XMODEM_BLOCK_MS / 1000.0);
+  while ((Count > 0) && (Uring->Failed == false)) {
+    UringReap( Session);
+    if (Uring->Writing || ((Uring->Output != NULL) && (Uring->OutputStart + Uring->OutputCount == URING_OUTPUT))) {
+      if (TimeNow() > Deadline) {
+        return false;
+      }
+      UringEnter( Session, Uring->Output == NULL, XMODEM_BLOCK_MS);
+      continue;
+    }
+    if ((Uring->Output == NULL) && (UringQueueOutput( Session) == false)) {
+      return false;
+    }
+    int Chunk = URING_OUTPUT - (Uring->OutputStart + Uring->OutputCount);
+    if (Chunk > Count) {
+      Chunk = Count;
+    }
+    memcpy( Uring->OutputBuffer + Uring->OutputStart + Uring->OutputCount, p, Chunk);
+    Uring->OutputCount += Chunk;
+    Uring->Output->len = Uring->OutputCount;
+    p += Chunk;
+    Count -= Chunk;
+  }
+  return Uring->Failed == false;
+}
+
+// ----------------------------------------------------------------------------
+//  Submit queued output and wait until it has all been written.
+// ----------------------------------------------------------------------------
+
+bool Sam9UringFlush( Sam9Session *Session) {
+  Sam9Uring *Uring = Session->Uring;
+  double Deadline = TimeNow() + (XMODEM_BLOCK_MS / 1000.0);
+  for (;;) {
+    UringReap( Session);
+    if (((Uring->Output == NULL) && (Uring->Writing == false)) || Uring->Failed || (TimeNow() > Deadline)) {
+      break;
+    }
+    UringEnter( Session, Uring->Output == NULL, XMODEM_BLOCK_MS);
+  }
+  return (Uring->Output == NULL) && (Uring->Writing == false) && (Uring->Failed == false);
+}
+
+#else
+
+bool Sam9UringOpen( Sam9Session *Session) {
+  fprintf( stderr, "*** %sio_uring is only available under Linux!\n", Session->Label);
+  return false;
+}
+
+void Sam9UringClose( Sam9Session *Session) {}
+int  Sam9UringFill( Sam9Session *Session, int Milliseconds) { return 0; }
+bool Sam9UringWrite( Sam9Session *Session, const void *Data, int Count) { return false; }
+bool Sam9UringFlush( Sam9Session *Session) { return false; }
+
+#endif
+
+// ----------------------------------------------------------------------------
+//  End
+// ----------------------------------------------------------------------------
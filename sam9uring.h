@@ -0,0 +1,46 @@
+// ----------------------------------------------------------------------------
+// sam9uring - io_uring serial transport for RomBOOT sessions.
+// ----------------------------------------------------------------------------
+//
+//   Copyright 2011 Michael E. Nagy
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+// ----------------------------------------------------------------------------
+//
+// With Options.Uring set a session moves its serial traffic through an
+// io_uring instead of write(), poll() and read().  A read into the session's
+// serial buffer is kept in flight at all times, so input that arrives while
+// the session is busy elsewhere costs no system call to collect, and
+// command output is gathered in a registered buffer and submitted together
+// with the next wait for a reply.  The functions below are called by
+// sam9lib.c when Session->Uring is set, callers never need them directly.
+//
+// ----------------------------------------------------------------------------
+
+#ifndef SAM9URING_H
+#define SAM9URING_H
+
+#include "sam9lib.h"
+
+bool   Sam9UringOpen( Sam9Session *Session);
+void   Sam9UringClose( Sam9Session *Session);
+int    Sam9UringFill( Sam9Session *Session, int Milliseconds);
+bool   Sam9UringWrite( Sam9Session *Session, const void *Data, int Count);
+bool   Sam9UringFlush( Sam9Session *Session);
+
+#endif
+
+// ----------------------------------------------------------------------------
+//  End
+// ----------------------------------------------------------------------------